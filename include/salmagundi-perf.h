@@ -0,0 +1,37 @@
+#ifndef C1F0E6A3D2B84E57A9E0F4B16D83C27A
+#define C1F0E6A3D2B84E57A9E0F4B16D83C27A
+// SPDX-License-Identifier: MIT OR Apache-2.0
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  HM_PERF_CYCLES,
+  HM_PERF_INSTRUCTIONS,
+  HM_PERF_CACHE_MISSES,
+  HM_PERF_BRANCH_MISSES,
+  HM_PERF_DTLB_MISSES,
+  HM_PERF_N,
+} hm_perf_counter_t;
+// Hardware counters around a measured region.
+// Counters the host does not offer (or does not allow) are reported as unavailable.
+typedef struct {
+  int fd[HM_PERF_N];
+  uint64_t val[HM_PERF_N];
+  struct timespec t0;
+  uint64_t ns;
+} hm_perf_t;
+hm_perf_t* hm_perf_open(void);
+void hm_perf_begin(hm_perf_t* perf);
+void hm_perf_end(hm_perf_t* perf);
+int8_t hm_perf_has(hm_perf_t* perf, hm_perf_counter_t c);
+void hm_perf_report(hm_perf_t* perf, char const* name, uint64_t n_op, FILE* out);
+void hm_perf_close(hm_perf_t* perf);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* C1F0E6A3D2B84E57A9E0F4B16D83C27A */
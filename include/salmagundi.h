@@ -9,38 +9,194 @@ extern "C" {
 
 typedef uint32_t hm_sz_t;
 typedef uint64_t hm_hash_t;
-typedef hm_hash_t (*hm_hash_func)(void const*, hm_sz_t);
+typedef hm_hash_t (*hm_hash_func)(void const*, hm_sz_t, hm_hash_t);
 typedef int8_t (*hm_cmp_func)(void const*, hm_sz_t, void const*, hm_sz_t);
 static hm_sz_t const HM_INITIAL_CAP = 1024;
+// A put which probes this far past the key's natural index reseeds and rehashes the map.
+static hm_sz_t const HM_PROBE_LIM = 128;
+// Snapshots share the live slot array in blocks of this many slots.
+static hm_sz_t const HM_SNAP_BLK = 64;
+// A tier rewrites its segment once this many bytes in it are dead, and they are half of it.
+static uint64_t const HM_TIER_COMPACT_MIN = 1 << 20;
 typedef struct {
   void* k;
   hm_sz_t k_sz;
   void* v;
   hm_sz_t v_sz;
 } hm_item_t;
+// A read-only view of a map as it was; Opaque, since readers and the map's writer share it atomically.
+typedef struct hm_snap_s hm_snap_t;
+// Memory a map let go of while snapshots were open, and the newest of them then.
+typedef struct {
+  void* p;
+  hm_sz_t gen;
+} hm_dead_t;
 typedef struct {
   hm_item_t* items;
   hm_sz_t cap;
   hm_sz_t sz;
   hm_hash_func hash;
   hm_cmp_func cmp;
+  hm_hash_t seed;
+  hm_sz_t reseed_sz;
+  // A mapping which the map unmaps on close.
+  // Keys and values inside of it are referenced, never copied or freed.
+  char* borrow;
+  size_t borrow_sz;
+  // Open snapshots (newest first), and what the map has let go of since they opened.
+  hm_snap_t* snaps;
+  hm_sz_t snap_gen;
+  hm_dead_t* dead;
+  size_t n_dead;
+  size_t dead_cap;
 #ifdef HM_DEBUG
   hm_sz_t n_collision;
   hm_sz_t n_probe;
   hm_sz_t n_grow;
+  hm_sz_t n_reseed;
 #endif
 } hm_t;
-hm_hash_t hm_hash_byte(void const* k, hm_sz_t k_sz);
-hm_hash_t hm_hash_djb1(void const* k, hm_sz_t k_sz);
-hm_hash_t hm_hash_rapidhash(void const* k, hm_sz_t k_sz);
+// Called by a merge on a key held by both maps, with dst's item and src's.
+// Whatever src still holds afterwards is freed. May run concurrently on distinct keys.
+typedef void (*hm_merge_func)(hm_item_t* dst, hm_item_t* src);
+// A counter in an aggregation's cache, hashed under its thread's map seed.
+typedef struct {
+  hm_hash_t h;
+  void* k;
+  hm_sz_t k_sz;
+  uint64_t n;
+} hm_agg_slot_t;
+// One thread's share of an aggregation, alone on its cache line (whatever the pointer size).
+typedef struct {
+  hm_t* map;
+  hm_agg_slot_t* cache;
+  hm_hash_t seed;
+  int8_t err;
+  char pad[64 - 2 * sizeof(void*) - sizeof(hm_hash_t) - sizeof(int8_t)];
+} hm_agg_local_t;
+typedef struct {
+  hm_agg_local_t* locals;
+  hm_sz_t n_thread;
+  hm_sz_t cache_cap;
+  hm_hash_func hash;
+  hm_cmp_func cmp;
+} hm_agg_t;
+typedef enum {
+  HM_LOAD_BIN,  // Records of "<u32le k_sz>k<u32le v_sz>v"
+  HM_LOAD_TSV,  // Lines of "k\tv\n"
+} hm_load_fmt_t;
+// A set stores only keys, in slots half the size of a map's.
+typedef struct {
+  void* k;
+  hm_sz_t k_sz;
+} hm_key_t;
+typedef struct {
+  hm_key_t* items;
+  hm_sz_t cap;
+  hm_sz_t sz;
+  hm_hash_func hash;
+  hm_cmp_func cmp;
+  hm_hash_t seed;
+  hm_sz_t reseed_sz;
+  // As for maps.
+  char* borrow;
+  size_t borrow_sz;
+#ifdef HM_DEBUG
+  hm_sz_t n_collision;
+  hm_sz_t n_probe;
+  hm_sz_t n_grow;
+  hm_sz_t n_reseed;
+#endif
+} hm_set_t;
+typedef struct {
+  hm_set_t* set;
+  size_t arena_sz;
+  // How much of the reserved arena is writable so far.
+  size_t arena_cap;
+} hm_intern_t;
+// Where a spilled entry's record starts in the segment, under its key's fingerprint.
+typedef struct {
+  uint64_t fp;
+  uint64_t off;
+} hm_tier_ref_t;
+/*  A map whose cold entries live in an append-only file.
+    The hot map is held to a budget of bytes (keys, values and a slot per entry);
+    A CLOCK sweep over its slots picks what to spill when it goes over. */
+typedef struct {
+  hm_t* hot;
+  size_t budget;
+  size_t hot_bytes;
+  uint8_t* refs;
+  hm_sz_t refs_cap;
+  hm_sz_t hand;
+  char* path;
+  int fd;
+  uint64_t log_sz;
+  uint64_t log_dead;
+  hm_tier_ref_t* index;
+  hm_sz_t index_cap;
+  hm_sz_t index_sz;
+  hm_hash_t seed;
+#ifdef HM_DEBUG
+  hm_sz_t n_spill;
+  hm_sz_t n_promote;
+  hm_sz_t n_compact;
+#endif
+} hm_tier_t;
+hm_hash_t hm_hash_byte(void const* k, hm_sz_t k_sz, hm_hash_t seed);
+hm_hash_t hm_hash_djb1(void const* k, hm_sz_t k_sz, hm_hash_t seed);
+hm_hash_t hm_hash_rapidhash(void const* k, hm_sz_t k_sz, hm_hash_t seed);
+void hm_hash_rapidhash_n(void const* const* ks, hm_sz_t const* k_szs, hm_sz_t n, hm_hash_t seed, hm_hash_t* hs);
+hm_hash_t hm_hash_u32(void const* k, hm_sz_t k_sz, hm_hash_t seed);
 int8_t hm_cmp_byte(void const* a, hm_sz_t a_sz, void const* b, hm_sz_t b_sz);
+int8_t hm_cmp_u32(void const* a, hm_sz_t a_sz, void const* b, hm_sz_t b_sz);
 int8_t hm_cmp_str(void const* a, hm_sz_t a_sz, void const* b, hm_sz_t b_sz);
 hm_t* hm_open(hm_hash_func hash, hm_cmp_func cmp);
 hm_sz_t hm_put(hm_t* map, void* k, hm_sz_t k_sz, void* v, hm_sz_t v_sz);
 hm_item_t hm_get(hm_t* map, void* k, hm_sz_t k_sz);
+void hm_hash_n(hm_t* map, void const* const* ks, hm_sz_t const* k_szs, hm_sz_t n, hm_hash_t* hs);
+void hm_get_n(hm_t* map, void* const* ks, hm_sz_t const* k_szs, hm_sz_t n, hm_item_t* out);
 int8_t hm_del(hm_t* map, void* k, hm_sz_t k_sz);
 int8_t hm_grow(hm_t* map);
+int8_t hm_reseed(hm_t* map);
+int8_t hm_reserve(hm_t* map, hm_sz_t sz);
+int8_t hm_merge(hm_t* dst, hm_t* src, hm_merge_func resolve);
+int8_t hm_merge_par(hm_t* dst, hm_t* src, hm_merge_func resolve, hm_sz_t n_thread);
+void hm_merge_add_u64(hm_item_t* dst, hm_item_t* src);
+hm_t* hm_load(char const* path, hm_load_fmt_t fmt, hm_hash_func hash, hm_cmp_func cmp, int8_t borrow, hm_sz_t n_thread);
+hm_agg_t* hm_agg_open(hm_sz_t n_thread, hm_hash_func hash, hm_cmp_func cmp, hm_sz_t cache_cap);
+hm_t* hm_agg_map(hm_agg_t* agg, hm_sz_t t);
+int8_t hm_agg_add_u64(hm_agg_t* agg, hm_sz_t t, void* k, hm_sz_t k_sz, uint64_t n);
+hm_t* hm_agg_reduce(hm_agg_t* agg, hm_merge_func resolve, hm_sz_t n_thread);
+void hm_agg_close(hm_agg_t* agg);
 void hm_close(hm_t* map);
+// Snapshots must be closed before their map; hm_close closes any left open, and their handles dangle after.
+hm_snap_t* hm_snapshot(hm_t* map);
+hm_sz_t hm_snap_sz(hm_snap_t const* snap);
+hm_sz_t hm_snap_cap(hm_snap_t const* snap);
+hm_item_t hm_snap_get(hm_snap_t* snap, void* k, hm_sz_t k_sz);
+hm_item_t hm_snap_item(hm_snap_t* snap, hm_sz_t idx);
+void hm_snap_close(hm_snap_t* snap);
+hm_set_t* hm_set_open(hm_hash_func hash, hm_cmp_func cmp);
+hm_sz_t hm_set_put(hm_set_t* set, void* k, hm_sz_t k_sz);
+int8_t hm_set_has(hm_set_t* set, void* k, hm_sz_t k_sz);
+int8_t hm_set_del(hm_set_t* set, void* k, hm_sz_t k_sz);
+int8_t hm_set_grow(hm_set_t* set);
+int8_t hm_set_reseed(hm_set_t* set);
+hm_set_t* hm_set_union(hm_set_t* a, hm_set_t* b);
+hm_set_t* hm_set_intersect(hm_set_t* a, hm_set_t* b);
+hm_set_t* hm_set_diff(hm_set_t* a, hm_set_t* b);
+void hm_set_close(hm_set_t* set);
+hm_intern_t* hm_intern_open(void);
+hm_sz_t hm_intern(hm_intern_t* pool, void const* k, hm_sz_t k_sz);
+hm_sz_t hm_intern_find(hm_intern_t* pool, void const* k, hm_sz_t k_sz);
+void const* hm_intern_bytes(hm_intern_t* pool, hm_sz_t handle, hm_sz_t* k_sz);
+void hm_intern_close(hm_intern_t* pool);
+hm_tier_t* hm_tier_open(char const* path, size_t budget, hm_hash_func hash, hm_cmp_func cmp);
+int8_t hm_tier_put(hm_tier_t* tier, void* k, hm_sz_t k_sz, void* v, hm_sz_t v_sz);
+hm_item_t hm_tier_get(hm_tier_t* tier, void* k, hm_sz_t k_sz, int8_t* status);
+int8_t hm_tier_del(hm_tier_t* tier, void* k, hm_sz_t k_sz);
+void hm_tier_close(hm_tier_t* tier);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,120 @@
+#define _DEFAULT_SOURCE
+#include "salmagundi-perf.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static char const* const hm_perf_names[HM_PERF_N] = {
+  "cycles",
+  "instructions",
+  "cache-misses",
+  "branch-misses",
+  "dtlb-misses",
+};
+
+#ifdef __linux__
+/*  Counters are opened one by one rather than as a group,
+    so that one missing counter does not take the others with it.
+    Kernel and hypervisor time is excluded, which is all an
+    unprivileged process may count under the default perf_event_paranoid. */
+static int hm_perf_open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+hm_perf_t* hm_perf_open(void) {
+  hm_perf_t* perf = calloc(sizeof(hm_perf_t), 1);
+  if (perf == NULL) {
+    return NULL;
+  }
+  for (int c = 0; c < HM_PERF_N; c++) {
+    perf->fd[c] = -1;
+  }
+#ifdef __linux__
+  perf->fd[HM_PERF_CYCLES] = hm_perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  perf->fd[HM_PERF_INSTRUCTIONS] = hm_perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  perf->fd[HM_PERF_CACHE_MISSES] = hm_perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  perf->fd[HM_PERF_BRANCH_MISSES] = hm_perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  perf->fd[HM_PERF_DTLB_MISSES] = hm_perf_open_counter(
+    PERF_TYPE_HW_CACHE,
+    PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+  return perf;
+}
+
+int8_t hm_perf_has(hm_perf_t* perf, hm_perf_counter_t c) {
+  return perf->fd[c] >= 0;
+}
+
+void hm_perf_begin(hm_perf_t* perf) {
+#ifdef __linux__
+  for (int c = 0; c < HM_PERF_N; c++) {
+    if (perf->fd[c] >= 0) {
+      ioctl(perf->fd[c], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf->fd[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &perf->t0);
+}
+
+void hm_perf_end(hm_perf_t* perf) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+#ifdef __linux__
+  for (int c = 0; c < HM_PERF_N; c++) {
+    if (perf->fd[c] < 0) {
+      continue;
+    }
+    ioctl(perf->fd[c], PERF_EVENT_IOC_DISABLE, 0);
+    // Value, time enabled, time running.
+    // When counters are multiplexed, the value is scaled up to the time enabled.
+    uint64_t r[3];
+    if (read(perf->fd[c], r, sizeof(r)) != sizeof(r) || r[2] == 0) {
+      perf->val[c] = 0;
+      continue;
+    }
+    perf->val[c] = r[2] < r[1] ? (uint64_t)((double)r[0] * r[1] / r[2]) : r[0];
+  }
+#endif
+  perf->ns = (uint64_t)(t1.tv_sec - perf->t0.tv_sec) * 1000000000ull + (uint64_t)t1.tv_nsec - (uint64_t)perf->t0.tv_nsec;
+}
+
+void hm_perf_report(hm_perf_t* perf, char const* name, uint64_t n_op, FILE* out) {
+  double n = n_op ? (double)n_op : 1;
+  fprintf(out, "%-24s n_op=%-10llu ns/op=%-8.2f", name, (unsigned long long)n_op, perf->ns / n);
+  for (int c = 0; c < HM_PERF_N; c++) {
+    if (perf->fd[c] >= 0) {
+      fprintf(out, " %s/op=%-8.3f", hm_perf_names[c], perf->val[c] / n);
+    } else {
+      fprintf(out, " %s/op=n/a     ", hm_perf_names[c]);
+    }
+  }
+  fprintf(out, "\n");
+}
+
+void hm_perf_close(hm_perf_t* perf) {
+#ifdef __linux__
+  for (int c = 0; c < HM_PERF_N; c++) {
+    if (perf->fd[c] >= 0) {
+      close(perf->fd[c]);
+    }
+  }
+#endif
+  free(perf);
+}
@@ -1,15 +1,34 @@
+// mmap flags, madvise, pread/pwrite and friends are POSIX or BSD, not ISO C.
+#define _DEFAULT_SOURCE
 #include "salmagundi.h"
 #include "rapidhash.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/random.h>)
+#include <sys/random.h>
+#define HM_HAVE_GETENTROPY 1
+#endif
+#endif
 
 #ifdef HM_DEBUG
 #include <stdio.h>
 #endif
 
-hm_hash_t hm_hash_byte(void const* k, hm_sz_t k_sz) {
+hm_hash_t hm_hash_byte(void const* k, hm_sz_t k_sz, hm_hash_t seed) {
   (void)k_sz;
+  (void)seed;
   return *(uint8_t*)k;
 }
 
@@ -21,22 +40,135 @@ int8_t hm_cmp_byte(void const* a, hm_sz_t a_sz, void const* b, hm_sz_t b_sz) {
 
 /*  The DJB-1 hash
     Daniel Bernstein's first implementation of a simple hash function
-    Ref http://www.cse.yorku.ca/~oz/hash.html */
-hm_hash_t hm_hash_djb1(void const* k, hm_sz_t k_sz) {
+    Ref http://www.cse.yorku.ca/~oz/hash.html
+    The seed only moves the starting point. Equal-length collisions
+    survive any seed, so prefer rapidhash for untrusted keys. */
+hm_hash_t hm_hash_djb1(void const* k, hm_sz_t k_sz, hm_hash_t seed) {
   uint8_t const* bytes = k;
-  hm_sz_t hash = 5381;
+  hm_hash_t hash = 5381 ^ seed;
   for (hm_sz_t i = 0; i < k_sz; i++) { hash = ((hash << 5) + hash) + bytes[i]; }
   return hash;
 }
 
-hm_hash_t hm_hash_rapidhash(void const* k, hm_sz_t k_sz) {
-  return rapidhash(k, k_sz);
+hm_hash_t hm_hash_rapidhash(void const* k, hm_sz_t k_sz, hm_hash_t seed) {
+  return rapidhash_withSeed(k, k_sz, seed);
+}
+
+/*  rapidhash for keys of up to 48 bytes, given a seed which has already been
+    through rapidhash's per-seed mixing. Mirrors rapidhash_internal. */
+static inline hm_hash_t hm_rapidhash_le48(uint8_t const* p, size_t len, uint64_t seed) {
+  uint64_t a, b;
+  seed ^= len;
+  if (len <= 16) {
+    if (len >= 4) {
+      uint8_t const* plast = p + len - 4;
+      a = (rapid_read32(p) << 32) | rapid_read32(plast);
+      uint64_t const delta = ((len & 24) >> (len >> 3));
+      b = ((rapid_read32(p + delta) << 32) | rapid_read32(plast - delta));
+    } else if (len > 0) {
+      a = rapid_readSmall(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    seed = rapid_mix(rapid_read64(p) ^ rapid_secret[2], rapid_read64(p + 8) ^ seed ^ rapid_secret[1]);
+    if (len > 32) {
+      seed = rapid_mix(rapid_read64(p + 16) ^ rapid_secret[2], rapid_read64(p + 24) ^ seed);
+    }
+    a = rapid_read64(p + len - 16);
+    b = rapid_read64(p + len - 8);
+  }
+  a ^= rapid_secret[1];
+  b ^= seed;
+  rapid_mum(&a, &b);
+  return rapid_mix(a ^ rapid_secret[0] ^ len, b ^ rapid_secret[1]);
+}
+
+static inline hm_hash_t hm_rapidhash_mixed(void const* k, hm_sz_t k_sz, hm_hash_t seed, hm_hash_t mixed_seed) {
+  return k_sz <= 48 ? hm_rapidhash_le48(k, k_sz, mixed_seed) : rapidhash_withSeed(k, k_sz, seed);
+}
+
+/*  Hashes n keys at once, bit for bit as hm_hash_rapidhash would.
+    The per-seed mixing is done once for the batch, there is no call through
+    a function pointer per key, and four keys are in flight at a time so that
+    their multiply chains overlap. There is no 64x64->128 bit multiply in
+    AVX2 or AVX-512, so the lanes are scalar rather than vector registers. */
+void hm_hash_rapidhash_n(void const* const* ks, hm_sz_t const* k_szs, hm_sz_t n, hm_hash_t seed, hm_hash_t* hs) {
+  hm_hash_t mixed_seed = seed ^ rapid_mix(seed ^ rapid_secret[0], rapid_secret[1]);
+  hm_sz_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    hm_hash_t h0 = hm_rapidhash_mixed(ks[i + 0], k_szs[i + 0], seed, mixed_seed);
+    hm_hash_t h1 = hm_rapidhash_mixed(ks[i + 1], k_szs[i + 1], seed, mixed_seed);
+    hm_hash_t h2 = hm_rapidhash_mixed(ks[i + 2], k_szs[i + 2], seed, mixed_seed);
+    hm_hash_t h3 = hm_rapidhash_mixed(ks[i + 3], k_szs[i + 3], seed, mixed_seed);
+    hs[i + 0] = h0;
+    hs[i + 1] = h1;
+    hs[i + 2] = h2;
+    hs[i + 3] = h3;
+  }
+  for (; i < n; i++) { hs[i] = hm_rapidhash_mixed(ks[i], k_szs[i], seed, mixed_seed); }
+}
+
+// For 32-bit keys, such as interned handles.
+hm_hash_t hm_hash_u32(void const* k, hm_sz_t k_sz, hm_hash_t seed) {
+  (void)k_sz;
+  uint32_t u;
+  memcpy(&u, k, sizeof(u));
+  return rapid_mix(u ^ seed, rapid_secret[0]);
+}
+
+int8_t hm_cmp_u32(void const* a, hm_sz_t a_sz, void const* b, hm_sz_t b_sz) {
+  (void)a_sz;
+  (void)b_sz;
+  uint32_t u;
+  uint32_t w;
+  memcpy(&u, a, sizeof(u));
+  memcpy(&w, b, sizeof(w));
+  return u == w ? 0 : -1;
 }
 
 int8_t hm_cmp_str(void const* a, hm_sz_t a_sz, void const* b, hm_sz_t b_sz) {
   return (a_sz == b_sz) ? memcmp(a, b, a_sz) : -1;
 }
 
+/*  Seeds need not be secret from the process, only from whoever picks the keys.
+    Every seed mixes a counter with a key drawn once from the OS's entropy source,
+    so that one map's seed tells nothing about another's. Only where there is no
+    such source does the key fall back to the time, which is guessable. */
+static hm_hash_t hm_seed_key[2];
+static pthread_once_t hm_seed_key_once = PTHREAD_ONCE_INIT;
+
+static void hm_seed_key_init(void) {
+#ifdef HM_HAVE_GETENTROPY
+  if (getentropy(hm_seed_key, sizeof(hm_seed_key)) == 0) {
+    return;
+  }
+#endif
+  hm_seed_key[0] = (hm_hash_t)time(NULL) ^ (hm_hash_t)clock();
+  hm_seed_key[1] = (hm_hash_t)(uintptr_t)&hm_seed_key;
+}
+
+// Maps may be opened on several threads at once, so the counter is atomic.
+static hm_hash_t hm_seed_next(void const* salt) {
+  static _Atomic hm_hash_t counter = 0;
+  pthread_once(&hm_seed_key_once, hm_seed_key_init);
+  hm_hash_t step = 0x9e3779b97f4a7c15ull;
+  hm_hash_t n = atomic_fetch_add_explicit(&counter, step, memory_order_relaxed) + step;
+  return rapid_mix(hm_seed_key[0] ^ n, hm_seed_key[1] ^ (hm_hash_t)(uintptr_t)salt);
+}
+
+// Keys and values inside a borrowed mapping belong to the mapping, not to the map (or set).
+static int8_t hm_is_borrowed(char* borrow, size_t borrow_sz, void* p) {
+  return (char*)p >= borrow && (char*)p < borrow + borrow_sz;
+}
+
+static void hm_free_owned(char* borrow, size_t borrow_sz, void* p) {
+  if (! hm_is_borrowed(borrow, borrow_sz, p)) {
+    free(p);
+  }
+}
+
 hm_t* hm_open(hm_hash_func hash, hm_cmp_func cmp) {
   hm_t* map = calloc(sizeof(hm_t), 1);
   if (map == NULL) {
@@ -50,40 +182,268 @@ hm_t* hm_open(hm_hash_func hash, hm_cmp_func cmp) {
   map->cap = HM_INITIAL_CAP;
   map->hash = hash;
   map->cmp = cmp;
+  map->seed = hm_seed_next(map);
   return map;
 }
 
-int8_t hm_grow(hm_t* map) {
-#ifdef HM_DEBUG
-  printf("Growing map of sz=%u from cap=%u to cap=%u\n", map->sz, map->cap, map->cap * 2);
-  map->n_grow++;
-#endif
-  hm_sz_t new_capacity = map->cap * 2;
-  hm_item_t* new_entries = calloc(new_capacity, sizeof(hm_item_t));
-  if (new_entries == NULL) {
+/*  Maps and sets share their probing code.
+    Both slot types lead with the key and its size, and differ only in stride. */
+typedef struct {
+  char* items;
+  size_t stride;
+  hm_sz_t cap;
+  hm_hash_func hash;
+  hm_cmp_func cmp;
+  hm_hash_t seed;
+} hm_tbl_t;
+
+_Static_assert(offsetof(hm_item_t, k) == offsetof(hm_key_t, k), "slot layouts must share a key prefix");
+_Static_assert(offsetof(hm_item_t, k_sz) == offsetof(hm_key_t, k_sz), "slot layouts must share a key prefix");
+
+static inline hm_tbl_t hm_tbl_of_map(hm_t* map) {
+  hm_tbl_t t = {(char*)map->items, sizeof(hm_item_t), map->cap, map->hash, map->cmp, map->seed};
+  return t;
+}
+
+static inline hm_tbl_t hm_tbl_of_set(hm_set_t* set) {
+  hm_tbl_t t = {(char*)set->items, sizeof(hm_key_t), set->cap, set->hash, set->cmp, set->seed};
+  return t;
+}
+
+static inline char* hm_tbl_slot(hm_tbl_t t, hm_sz_t idx) {
+  return t.items + (size_t)idx * t.stride;
+}
+
+static inline void* hm_tbl_k(hm_tbl_t t, hm_sz_t idx) {
+  return *(void**)(hm_tbl_slot(t, idx) + offsetof(hm_key_t, k));
+}
+
+static inline hm_sz_t hm_tbl_k_sz(hm_tbl_t t, hm_sz_t idx) {
+  return *(hm_sz_t*)(hm_tbl_slot(t, idx) + offsetof(hm_key_t, k_sz));
+}
+
+/*  A linear collision resolution strategy
+    Ref https://en.wikipedia.org/wiki/Linear_probing
+    Returns the index holding k, or the empty index where k would go.
+    The number of occupied slots walked past is left in n_probe. */
+static inline hm_sz_t hm_tbl_probe_hashed(
+  hm_tbl_t t,
+  hm_hash_t h,
+  void const* k,
+  hm_sz_t k_sz,
+  int8_t* found,
+  hm_sz_t* n_probe) {
+  hm_sz_t idx = h % t.cap;
+  *n_probe = 0;
+  while (hm_tbl_k(t, idx) != NULL) {
+    if (t.cmp(hm_tbl_k(t, idx), hm_tbl_k_sz(t, idx), k, k_sz) == 0) {
+      *found = 1;
+      return idx;
+    }
+    idx = (idx + 1) % t.cap;
+    (*n_probe)++;
+  }
+  *found = 0;
+  return idx;
+}
+
+static inline hm_sz_t hm_tbl_probe(hm_tbl_t t, void const* k, hm_sz_t k_sz, int8_t* found, hm_sz_t* n_probe) {
+  return hm_tbl_probe_hashed(t, t.hash(k, k_sz, t.seed), k, k_sz, found, n_probe);
+}
+
+// Moves every slot into a fresh array of new_cap slots. The old one is left to the caller.
+static char* hm_tbl_rehash(hm_tbl_t t, hm_sz_t new_cap) {
+  char* new_items = calloc(new_cap, t.stride);
+  if (new_items == NULL) {
+    return NULL;
+  }
+  for (hm_sz_t i = 0; i < t.cap; i++) {
+    if (hm_tbl_k(t, i) != NULL) {
+      hm_sz_t idx = t.hash(hm_tbl_k(t, i), hm_tbl_k_sz(t, i), t.seed) % new_cap;
+      while (*(void**)(new_items + (size_t)idx * t.stride) != NULL) {
+        idx = (idx + 1) % new_cap;
+      }
+      memcpy(new_items + (size_t)idx * t.stride, hm_tbl_slot(t, i), t.stride);
+    }
+  }
+  return new_items;
+}
+
+// Clears the slot at idx. Its contents must already be freed (or moved).
+static void hm_tbl_unlink(hm_tbl_t t, hm_sz_t idx) {
+  memset(hm_tbl_slot(t, idx), 0, t.stride);
+  // There might be collisions (same hash, different key)
+  // after this index, which we need to shift back into the hole.
+  hm_sz_t next_idx = idx;
+  while (1) {
+    next_idx = (next_idx + 1) % t.cap;
+    if (hm_tbl_k(t, next_idx) == NULL) {
+      break;
+    }
+    hm_sz_t natural_idx = t.hash(hm_tbl_k(t, next_idx), hm_tbl_k_sz(t, next_idx), t.seed) % t.cap;
+    // Items whose natural index lies after the hole (cyclically, up to their
+    // own index) are still reachable. Shifting them back would lose them.
+    int8_t is_after_hole = idx <= next_idx ? (idx < natural_idx && natural_idx <= next_idx)
+                                           : (idx < natural_idx || natural_idx <= next_idx);
+    if (is_after_hole) {
+      continue;
+    }
+    memcpy(hm_tbl_slot(t, idx), hm_tbl_slot(t, next_idx), t.stride);
+    memset(hm_tbl_slot(t, next_idx), 0, t.stride);
+    idx = next_idx;
+  }
+}
+
+/*  Snapshots share the live slot array a block at a time.
+    Before a writer changes a block, it gives every snapshot still sharing
+    that block a copy of it as it was. Keys, values and slot arrays which the
+    live map lets go of are kept until the last snapshot closes.
+    A snapshot reads a shared block's slot, then checks that the block was not
+    copied out from under it in the meantime, much like a seqlock's reader.
+    That slot read is a plain one, racing the writer; A torn result is only ever
+    returned if no copy was published, and the writer publishes before it writes.
+    This relies on the compiler (GCC or Clang) not inventing reads or writes of
+    the slot, as seqlocks written in C always have. */
+struct hm_snap_s {
+  hm_t* map;
+  // The live slot array, and the blocks of it copied out before they changed.
+  hm_item_t* items;
+  _Atomic(hm_item_t*)* blks;
+  hm_sz_t cap;
+  hm_sz_t sz;
+  hm_hash_func hash;
+  hm_cmp_func cmp;
+  hm_hash_t seed;
+  hm_sz_t gen;
+  hm_snap_t* next;
+};
+
+static int8_t hm_snap_preserve(hm_snap_t* snap, hm_sz_t blk) {
+  if (atomic_load_explicit(&snap->blks[blk], memory_order_relaxed) != NULL) {
+    return 0;
+  }
+  hm_sz_t n = snap->cap - blk * HM_SNAP_BLK < HM_SNAP_BLK ? snap->cap - blk * HM_SNAP_BLK : HM_SNAP_BLK;
+  hm_item_t* copy = malloc(n * sizeof(hm_item_t));
+  if (copy == NULL) {
     return -1;
   }
-  for (hm_sz_t i = 0; i < map->cap; i++) {
-    if (map->items[i].k != NULL) {
-      hm_item_t item = map->items[i];
-      hm_sz_t idx = map->hash(item.k, item.k_sz) % new_capacity;
-      while (new_entries[idx].k != NULL) {
-        idx = (idx + 1) % new_capacity;
+  memcpy(copy, &snap->items[blk * HM_SNAP_BLK], n * sizeof(hm_item_t));
+  atomic_store_explicit(&snap->blks[blk], copy, memory_order_release);
+  return 0;
+}
+
+// Called before the live map writes the slot at idx.
+static int8_t hm_snap_touch(hm_t* map, hm_sz_t idx) {
+  for (hm_snap_t* snap = map->snaps; snap != NULL; snap = snap->next) {
+    if (snap->items == map->items && hm_snap_preserve(snap, idx / HM_SNAP_BLK) != 0) {
+      return -1;
+    }
+  }
+  // The slot write which follows must not be seen before the copy is published.
+  atomic_thread_fence(memory_order_release);
+  return 0;
+}
+
+// Called before a deletion shifts back the run starting at idx.
+static int8_t hm_snap_touch_run(hm_t* map, hm_sz_t idx) {
+  do {
+    if (hm_snap_touch(map, idx) != 0) {
+      return -1;
+    }
+    idx = (idx + 1) % map->cap;
+  } while (map->items[idx].k != NULL);
+  return hm_snap_touch(map, idx);
+}
+
+// Called before the live map lets go of its slot array.
+static int8_t hm_snap_detach(hm_t* map) {
+  for (hm_snap_t* snap = map->snaps; snap != NULL; snap = snap->next) {
+    for (hm_sz_t blk = 0; snap->items == map->items && blk * HM_SNAP_BLK < snap->cap; blk++) {
+      if (hm_snap_preserve(snap, blk) != 0) {
+        return -1;
       }
-      new_entries[idx] = map->items[i];
     }
   }
-  free(map->items);
+  return 0;
+}
+
+// Frees memory the live map is done with, or defers that while a snapshot might still read it.
+static void hm_release(hm_t* map, void* p) {
+  if (p == NULL || hm_is_borrowed(map->borrow, map->borrow_sz, p)) {
+    return;
+  }
+  if (map->snaps == NULL) {
+    free(p);
+    return;
+  }
+  if (map->n_dead == map->dead_cap) {
+    size_t dead_cap = map->dead_cap ? map->dead_cap * 2 : 64;
+    hm_dead_t* dead = realloc(map->dead, dead_cap * sizeof(hm_dead_t));
+    if (dead == NULL) {
+      // Leaking is the lesser evil, next to freeing what a reader may hold.
+      return;
+    }
+    map->dead = dead;
+    map->dead_cap = dead_cap;
+  }
+  // Snapshots taken from now on cannot see p, so it waits only on those open now.
+  map->dead[map->n_dead++] = (hm_dead_t){p, map->snaps->gen};
+}
+
+/*  Values which are borrowed, or which a snapshot may see, are never written in place.
+    A live value was in the newest snapshot if it is older than it, and is in no snapshot
+    if it is newer; So a lookup in the newest snapshot tells which. */
+static int8_t hm_is_shared(hm_t* map, hm_item_t const* item) {
+  return hm_is_borrowed(map->borrow, map->borrow_sz, item->v)
+      || (map->snaps != NULL && hm_snap_get(map->snaps, item->k, item->k_sz).v == item->v);
+}
+
+static int8_t hm_rehash(hm_t* map, hm_sz_t new_capacity) {
+  hm_item_t* new_entries = (hm_item_t*)hm_tbl_rehash(hm_tbl_of_map(map), new_capacity);
+  if (new_entries == NULL) {
+    return -1;
+  }
+  if (hm_snap_detach(map) != 0) {
+    free(new_entries);
+    return -1;
+  }
+  hm_release(map, map->items);
   map->items = new_entries;
   map->cap = new_capacity;
+  return 0;
+}
+
+int8_t hm_grow(hm_t* map) {
+#ifdef HM_DEBUG
+  printf("Growing map of sz=%u from cap=%u to cap=%u\n", map->sz, map->cap, map->cap * 2);
+  map->n_grow++;
+#endif
+  if (hm_rehash(map, map->cap * 2) != 0) {
+    return -1;
+  }
 #ifdef HM_DEBUG
   printf("Map grown, cap=%u, sz=%u\n", map->cap, map->sz);
 #endif
   return 0;
 }
 
-/*  A linear collision resolution strategy
-    Ref https://en.wikipedia.org/wiki/Linear_probing */
+/*  Picks a new seed and rehashes in place.
+    A long probe run under one seed is very unlikely to survive another,
+    unless the hash function ignores its seed. */
+int8_t hm_reseed(hm_t* map) {
+  hm_hash_t old_seed = map->seed;
+  map->seed = hm_seed_next(map->items) ^ old_seed;
+  if (hm_rehash(map, map->cap) != 0) {
+    map->seed = old_seed;
+    return -1;
+  }
+  map->reseed_sz = map->sz;
+#ifdef HM_DEBUG
+  map->n_reseed++;
+#endif
+  return 0;
+}
+
 hm_sz_t hm_put(hm_t* map, void* k, hm_sz_t k_sz, void* v, hm_sz_t v_sz) {
   if (map->sz >= map->cap * 0.75) {
     // It is healthy not to use the map at its full capacity.
@@ -93,29 +453,34 @@ hm_sz_t hm_put(hm_t* map, void* k, hm_sz_t k_sz, void* v, hm_sz_t v_sz) {
       return -1;
     }
   }
-  hm_sz_t idx = map->hash(k, k_sz) % map->cap;
-  hm_sz_t is_overwrite = 0;
-  while(1) {
-    if (map->items[idx].k == NULL) {
-      // No key at this index. We can put one here.
-      break;
-    } else if (map->cmp(map->items[idx].k, map->items[idx].k_sz, k, k_sz) == 0) {
-      // Key already exists (hash and memory match). We can update the value.
-      is_overwrite = 1;
-      break;
-    } else {
-      // Bump the index and try again.
-      idx = (idx + 1) % map->cap;
+  int8_t is_overwrite;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe(hm_tbl_of_map(map), k, k_sz, &is_overwrite, &n_probe);
 #ifdef HM_DEBUG
-      map->n_collision++;
+  map->n_collision += n_probe;
 #endif
+  // A run this long means the keys are unlucky (or hostile) under this seed.
+  // Reseeding is only allowed again once the map has doubled, which keeps
+  // the rehashing amortized if the hash function happens to ignore seeds.
+  if (n_probe >= HM_PROBE_LIM && map->sz >= map->reseed_sz * 2) {
+    if (hm_reseed(map) != 0) {
+      return -1;
     }
+    return hm_put(map, k, k_sz, v, v_sz);
+  }
+  if (map->snaps != NULL && hm_snap_touch(map, idx) != 0) {
+    return -1;
   }
   hm_item_t* item = &map->items[idx];
   if (is_overwrite) {
     // An update; The key already exists here, but the value changed.
-    // Need new memory for the new value.
-    item->v = realloc(map->items[idx].v, v_sz);
+    // Need new memory for the new value. A shared one cannot be resized.
+    void* old_v = item->v;
+    int8_t is_shared = hm_is_shared(map, item);
+    item->v = is_shared ? malloc(v_sz) : realloc(old_v, v_sz);
+    if (is_shared && item->v != NULL) {
+      hm_release(map, old_v);
+    }
   } else {
     // A "pure" insertion; Nothing exists here yet.
     // Need new memory for the key and value.
@@ -124,85 +489,1596 @@ hm_sz_t hm_put(hm_t* map, void* k, hm_sz_t k_sz, void* v, hm_sz_t v_sz) {
     item->v = malloc(v_sz);
   }
   if (item->k == NULL || item->v == NULL) {
-    free(item->k);
-    free(item->v);
+    hm_release(map, item->k);
+    hm_release(map, item->v);
     memset(item, 0, sizeof(hm_item_t));
     return -1;
   }
-  memcpy(item->k, k, k_sz);
+  if (! is_overwrite) {
+    // The stored key compares equal on an overwrite, and may be borrowed.
+    memcpy(item->k, k, k_sz);
+    item->k_sz = k_sz;
+  }
   memcpy(item->v, v, v_sz);
-  item->k_sz = k_sz;
   item->v_sz = v_sz;
   map->sz += !is_overwrite;
   return idx;
 }
 
 hm_item_t hm_get(hm_t* map, void* k, hm_sz_t k_sz) {
-  hm_sz_t idx = map->hash(k, k_sz) % map->cap;
-  while (map->items[idx].k != NULL) {
-    if (map->cmp(map->items[idx].k, map->items[idx].k_sz, k, k_sz) == 0) {
-      return map->items[idx];
-    }
-    idx = (idx + 1) % map->cap;
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe(hm_tbl_of_map(map), k, k_sz, &found, &n_probe);
 #ifdef HM_DEBUG
-    map->n_probe++;
+  map->n_probe += n_probe;
 #endif
+  if (found) {
+    return map->items[idx];
   }
   hm_item_t none;
   memset(&none, 0, sizeof(hm_item_t));
   return none;
 }
 
-int8_t hm_del(hm_t* map, void* k, hm_sz_t k_sz) {
-  hm_sz_t idx = map->hash(k, k_sz) % map->cap;
-  while (1) {
-    hm_item_t* item = &map->items[idx];
-    if (item->k == NULL) {
-      break;
-    }
-    if (map->cmp(item->k, item->k_sz, k, k_sz) != 0) {
-      idx = (idx + 1) % map->cap;
-      continue;
-    }
-    free(item->k);
-    free(item->v);
-    memset(item, 0, sizeof(hm_item_t));
-    map->sz--;
-    // Cannot return just yet. There might be collisions (same hash, different key)
-    // right after this index, which we need to shift back.
-    while (1) {
-      hm_sz_t next_idx = (idx + 1) % map->cap;
-      hm_item_t* next_item = &map->items[next_idx];
-      if (next_item->k == NULL) {
-        break;
-      }
-      if (map->hash(next_item->k, next_item->k_sz) % map->cap == next_idx) {
-        // Next item is at its "natural" index. No need to shift it back.
-        // Unlikely; The key->index mapping is a bit entangled if we're here too often.
-        break;
+// Hashes n keys with the map's hash function and seed.
+void hm_hash_n(hm_t* map, void const* const* ks, hm_sz_t const* k_szs, hm_sz_t n, hm_hash_t* hs) {
+  if (map->hash == hm_hash_rapidhash) {
+    hm_hash_rapidhash_n(ks, k_szs, n, map->seed, hs);
+    return;
+  }
+  for (hm_sz_t i = 0; i < n; i++) { hs[i] = map->hash(ks[i], k_szs[i], map->seed); }
+}
+
+/*  Looks up n keys, as hm_get would, into out.
+    Keys are hashed a block at a time, and the block's slots are
+    prefetched before any of them is probed. */
+void hm_get_n(hm_t* map, void* const* ks, hm_sz_t const* k_szs, hm_sz_t n, hm_item_t* out) {
+  hm_hash_t hs[64];
+  hm_tbl_t t = hm_tbl_of_map(map);
+  for (hm_sz_t base = 0; base < n; base += 64) {
+    hm_sz_t n_block = n - base < 64 ? n - base : 64;
+    hm_hash_n(map, (void const* const*)&ks[base], &k_szs[base], n_block, hs);
+#if defined(__GNUC__) || defined(__clang__)
+    for (hm_sz_t i = 0; i < n_block; i++) { __builtin_prefetch(&map->items[hs[i] % map->cap]); }
+#endif
+    for (hm_sz_t i = 0; i < n_block; i++) {
+      int8_t found;
+      hm_sz_t n_probe;
+      hm_sz_t idx = hm_tbl_probe_hashed(t, hs[i], ks[base + i], k_szs[base + i], &found, &n_probe);
+#ifdef HM_DEBUG
+      map->n_probe += n_probe;
+#endif
+      if (found) {
+        out[base + i] = map->items[idx];
+      } else {
+        memset(&out[base + i], 0, sizeof(hm_item_t));
       }
-      memcpy(item, next_item, sizeof(hm_item_t));
-      memset(next_item, 0, sizeof(hm_item_t));
-      idx = next_idx;
     }
-    return 1;
+  }
+}
+
+int8_t hm_del(hm_t* map, void* k, hm_sz_t k_sz) {
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_tbl_t t = hm_tbl_of_map(map);
+  hm_sz_t idx = hm_tbl_probe(t, k, k_sz, &found, &n_probe);
 #ifdef HM_DEBUG
-    map->n_probe++;
+  map->n_probe += n_probe;
 #endif
+  if (! found) {
+    return 0;
   }
-  return 0;
+  if (map->snaps != NULL && hm_snap_touch_run(map, idx) != 0) {
+    return -1;
+  }
+  // Only what the newest snapshot sees has to wait for the snapshots to close.
+  hm_item_t item = map->items[idx];
+  hm_item_t seen;
+  memset(&seen, 0, sizeof(hm_item_t));
+  if (map->snaps != NULL) {
+    seen = hm_snap_get(map->snaps, item.k, item.k_sz);
+  }
+  if (seen.k == item.k) {
+    hm_release(map, item.k);
+  } else {
+    hm_free_owned(map->borrow, map->borrow_sz, item.k);
+  }
+  if (seen.v == item.v) {
+    hm_release(map, item.v);
+  } else {
+    hm_free_owned(map->borrow, map->borrow_sz, item.v);
+  }
+  hm_tbl_unlink(t, idx);
+  map->sz--;
+  return 1;
 }
 
 void hm_close(hm_t* map) {
+  while (map->snaps != NULL) {
+    hm_snap_close(map->snaps);
+  }
   for (hm_sz_t i = 0; i < map->cap; i++) {
     if (map->items[i].k != NULL) {
-      free(map->items[i].k);
-      free(map->items[i].v);
+      hm_free_owned(map->borrow, map->borrow_sz, map->items[i].k);
+      hm_free_owned(map->borrow, map->borrow_sz, map->items[i].v);
       memset(&map->items[i], 0, sizeof(hm_item_t));
     }
   }
   free(map->items);
   map->items = NULL;
+  if (map->borrow != NULL) {
+    munmap(map->borrow, map->borrow_sz);
+  }
   free(map);
   map = NULL;
 }
+
+// Grows the map once, so that sz items fit without growing again.
+int8_t hm_reserve(hm_t* map, hm_sz_t sz) {
+  hm_sz_t new_capacity = map->cap;
+  while (sz >= new_capacity * 0.75) {
+    new_capacity *= 2;
+  }
+  if (new_capacity == map->cap) {
+    return 0;
+  }
+  if (hm_rehash(map, new_capacity) != 0) {
+    return -1;
+  }
+#ifdef HM_DEBUG
+  map->n_grow++;
+#endif
+  return 0;
+}
+
+// The default resolution, which is what hm_put would do: src wins.
+static void hm_merge_take_src(hm_item_t* dst, hm_item_t* src) {
+  hm_item_t swap = *dst;
+  dst->v = src->v;
+  dst->v_sz = src->v_sz;
+  src->v = swap.v;
+  src->v_sz = swap.v_sz;
+}
+
+/*  Moves an item, already hashed with the map's seed, into the map.
+    Gives up (-1) after walking n_step_lim slots, which bounds a probe to one partition.
+    Returns 1 when the item took a new slot, and 0 when it was resolved into an existing one.
+    Either way, the item is left zeroed. Out of memory, returns -2 and leaves the item be. */
+static int8_t hm_place(hm_t* map, hm_hash_t h, hm_item_t* item, hm_merge_func resolve, hm_sz_t n_step_lim) {
+  hm_sz_t idx = h % map->cap;
+  for (hm_sz_t n_step = 0; n_step < n_step_lim; n_step++) {
+    hm_item_t* slot = &map->items[idx];
+    int8_t is_empty = slot->k == NULL;
+    if (! is_empty && map->cmp(slot->k, slot->k_sz, item->k, item->k_sz) != 0) {
+      idx = (idx + 1) % map->cap;
+      continue;
+    }
+    if (map->snaps != NULL && hm_snap_touch(map, idx) != 0) {
+      return -2;
+    }
+    if (is_empty) {
+      *slot = *item;
+      memset(item, 0, sizeof(hm_item_t));
+      return 1;
+    }
+    if (hm_is_shared(map, slot)) {
+      // Resolvers may write through dst's value, so give them a copy of their own.
+      void* v = malloc(slot->v_sz ? slot->v_sz : 1);
+      if (v == NULL) {
+        return -2;
+      }
+      memcpy(v, slot->v, slot->v_sz);
+      hm_release(map, slot->v);
+      slot->v = v;
+    }
+    resolve(slot, item);
+    // What is left of the item came from elsewhere, so no snapshot of this map has seen it.
+    hm_free_owned(map->borrow, map->borrow_sz, item->k);
+    hm_free_owned(map->borrow, map->borrow_sz, item->v);
+    memset(item, 0, sizeof(hm_item_t));
+    return 0;
+  }
+  return -1;
+}
+
+typedef struct {
+  void (*fn)(void*, hm_sz_t);
+  void* arg;
+  hm_sz_t t;
+} hm_par_job_t;
+
+static void* hm_par_job_run(void* job) {
+  hm_par_job_t* j = job;
+  j->fn(j->arg, j->t);
+  return NULL;
+}
+
+// Runs fn(arg, t) for each t in [0, n_thread), one thread each.
+// Jobs which cannot get a thread of their own run on the calling thread.
+static void hm_par(hm_sz_t n_thread, void (*fn)(void*, hm_sz_t), void* arg) {
+  pthread_t* threads = calloc(n_thread, sizeof(pthread_t));
+  hm_par_job_t* jobs = calloc(n_thread, sizeof(hm_par_job_t));
+  int8_t* started = calloc(n_thread, sizeof(int8_t));
+  for (hm_sz_t t = 1; threads != NULL && jobs != NULL && started != NULL && t < n_thread; t++) {
+    jobs[t] = (hm_par_job_t){fn, arg, t};
+    started[t] = pthread_create(&threads[t], NULL, hm_par_job_run, &jobs[t]) == 0;
+  }
+  for (hm_sz_t t = 0; t < n_thread; t++) {
+    if (started == NULL || ! started[t]) {
+      fn(arg, t);
+    }
+  }
+  for (hm_sz_t t = 1; started != NULL && t < n_thread; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  free(threads);
+  free(jobs);
+  free(started);
+}
+
+/*  A partitioned bulk insertion.
+    The slot array is cut into n_part contiguous ranges, and items are bucketed
+    by the range their natural index falls in. Each range is then filled by
+    one thread, which never writes outside of it. Probe runs which would
+    spill over a range's end are deferred to a serial pass afterwards. */
+typedef struct {
+  hm_t* map;
+  hm_item_t* items;
+  hm_sz_t n;
+  hm_merge_func resolve;
+  hm_sz_t n_part;
+  hm_sz_t range;
+  hm_hash_t* hs;
+  hm_sz_t* order;
+  hm_sz_t* counts;
+  hm_sz_t* part_begin;
+  hm_sz_t* n_placed;
+  hm_sz_t* n_deferred;
+} hm_bulk_t;
+
+static hm_sz_t hm_bulk_part(hm_bulk_t* b, hm_hash_t h) {
+  return (h % b->map->cap) / b->range;
+}
+
+// Hashes one chunk of the items, and counts them by partition.
+static void hm_bulk_hash(void* arg, hm_sz_t t) {
+  hm_bulk_t* b = arg;
+  hm_t* map = b->map;
+  hm_sz_t* counts = &b->counts[(size_t)t * b->n_part];
+  for (hm_sz_t i = (size_t)b->n * t / b->n_part; i < (size_t)b->n * (t + 1) / b->n_part; i++) {
+    if (b->items[i].k != NULL) {
+      b->hs[i] = map->hash(b->items[i].k, b->items[i].k_sz, map->seed);
+      counts[hm_bulk_part(b, b->hs[i])]++;
+    }
+  }
+}
+
+// Scatters one chunk of the items into the partition order.
+static void hm_bulk_scatter(void* arg, hm_sz_t t) {
+  hm_bulk_t* b = arg;
+  hm_sz_t* offsets = &b->counts[(size_t)t * b->n_part];
+  for (hm_sz_t i = (size_t)b->n * t / b->n_part; i < (size_t)b->n * (t + 1) / b->n_part; i++) {
+    if (b->items[i].k != NULL) {
+      b->order[offsets[hm_bulk_part(b, b->hs[i])]++] = i;
+    }
+  }
+}
+
+// Fills one partition. Deferred items are compacted to the front of its order.
+static void hm_bulk_place(void* arg, hm_sz_t p) {
+  hm_bulk_t* b = arg;
+  hm_sz_t hi = (p + 1) * b->range < b->map->cap ? (p + 1) * b->range : b->map->cap;
+  for (hm_sz_t o = b->part_begin[p]; o < b->part_begin[p + 1]; o++) {
+    hm_sz_t i = b->order[o];
+    hm_sz_t n_step_lim = hi - b->hs[i] % b->map->cap;
+    int8_t placed = hm_place(b->map, b->hs[i], &b->items[i], b->resolve, n_step_lim);
+    if (placed < 0) {
+      b->order[b->part_begin[p] + b->n_deferred[p]++] = i;
+    } else {
+      b->n_placed[p] += placed;
+    }
+  }
+}
+
+/*  Moves the n items (empty ones skipped) into the map, leaving them zeroed.
+    Keys already in the map are handed to resolve.
+    The map is sized once up front, for the worst case of no shared keys. */
+static int8_t hm_put_moved(hm_t* map, hm_item_t* items, hm_sz_t n, hm_merge_func resolve, hm_sz_t n_thread) {
+  hm_sz_t n_item = 0;
+  for (hm_sz_t i = 0; i < n; i++) {
+    n_item += items[i].k != NULL;
+  }
+  if (hm_reserve(map, map->sz + n_item) != 0) {
+    return -1;
+  }
+  resolve = resolve == NULL ? hm_merge_take_src : resolve;
+  // Small partitions would mostly spill, so there are at most cap / HM_INITIAL_CAP.
+  // Snapshots are kept up to date one slot at a time, so they need a single writer.
+  hm_sz_t n_part = n_thread < map->cap / HM_INITIAL_CAP ? n_thread : map->cap / HM_INITIAL_CAP;
+  if (n_part <= 1 || n_item < HM_INITIAL_CAP || map->snaps != NULL) {
+    for (hm_sz_t i = 0; i < n; i++) {
+      if (items[i].k != NULL) {
+        hm_hash_t h = map->hash(items[i].k, items[i].k_sz, map->seed);
+        int8_t placed = hm_place(map, h, &items[i], resolve, map->cap);
+        if (placed < 0) {
+          return -1;
+        }
+        map->sz += placed;
+      }
+    }
+    return 0;
+  }
+  hm_bulk_t b = {
+    .map = map,
+    .items = items,
+    .n = n,
+    .resolve = resolve,
+    .n_part = n_part,
+    .range = (map->cap + n_part - 1) / n_part,
+  };
+  b.hs = malloc((size_t)n * sizeof(hm_hash_t));
+  b.order = malloc((size_t)n_item * sizeof(hm_sz_t));
+  b.counts = calloc((size_t)n_part * n_part, sizeof(hm_sz_t));
+  b.part_begin = calloc(n_part + 1, sizeof(hm_sz_t));
+  b.n_placed = calloc(n_part, sizeof(hm_sz_t));
+  b.n_deferred = calloc(n_part, sizeof(hm_sz_t));
+  int8_t ok = b.hs != NULL && b.order != NULL && b.counts != NULL && b.part_begin != NULL && b.n_placed != NULL
+           && b.n_deferred != NULL;
+  if (ok) {
+    hm_par(n_part, hm_bulk_hash, &b);
+    // Turn the per-chunk counts into offsets, with each partition's items contiguous.
+    hm_sz_t offset = 0;
+    for (hm_sz_t p = 0; p < n_part; p++) {
+      b.part_begin[p] = offset;
+      for (hm_sz_t t = 0; t < n_part; t++) {
+        hm_sz_t count = b.counts[(size_t)t * n_part + p];
+        b.counts[(size_t)t * n_part + p] = offset;
+        offset += count;
+      }
+    }
+    b.part_begin[n_part] = offset;
+    hm_par(n_part, hm_bulk_scatter, &b);
+    hm_par(n_part, hm_bulk_place, &b);
+    for (hm_sz_t p = 0; p < n_part; p++) {
+      map->sz += b.n_placed[p];
+      for (hm_sz_t o = b.part_begin[p]; ok && o < b.part_begin[p] + b.n_deferred[p]; o++) {
+        hm_sz_t i = b.order[o];
+        int8_t placed = hm_place(map, b.hs[i], &items[i], resolve, map->cap);
+        ok = placed >= 0;
+        map->sz += ok ? placed : 0;
+      }
+    }
+  }
+  free(b.hs);
+  free(b.order);
+  free(b.counts);
+  free(b.part_begin);
+  free(b.n_placed);
+  free(b.n_deferred);
+  return ok ? 0 : -1;
+}
+
+/*  Moves every item of src into dst, leaving src empty (but open).
+    Keys and values change owners rather than being copied.
+    Both maps should agree on what a key is. A NULL resolve lets src win, like hm_put.
+    Should it run out of memory partway (-1), what was moved stays in dst and the
+    rest stays in src, and both remain usable maps. */
+int8_t hm_merge(hm_t* dst, hm_t* src, hm_merge_func resolve) {
+  return hm_merge_par(dst, src, resolve, 1);
+}
+
+int8_t hm_merge_par(hm_t* dst, hm_t* src, hm_merge_func resolve, hm_sz_t n_thread) {
+  // dst could not tell borrowed items from its own,
+  // and src's snapshots would lose items out from under them.
+  if (src->borrow != NULL || src->snaps != NULL) {
+    return -1;
+  }
+  if (hm_put_moved(dst, src->items, src->cap, resolve, n_thread) != 0) {
+    // Moved items left holes in src's probe runs; Rehashing closes them.
+    src->sz = 0;
+    for (hm_sz_t i = 0; i < src->cap; i++) {
+      src->sz += src->items[i].k != NULL;
+    }
+    hm_rehash(src, src->cap);
+    return -1;
+  }
+  src->sz = 0;
+  return 0;
+}
+
+void hm_merge_add_u64(hm_item_t* dst, hm_item_t* src) {
+  *(uint64_t*)dst->v += *(uint64_t*)src->v;
+}
+
+_Static_assert(sizeof(hm_agg_local_t) == 64, "thread locals should fill exactly one cache line");
+
+hm_agg_t* hm_agg_open(hm_sz_t n_thread, hm_hash_func hash, hm_cmp_func cmp, hm_sz_t cache_cap) {
+  hm_agg_t* agg = calloc(sizeof(hm_agg_t), 1);
+  if (agg == NULL) {
+    return NULL;
+  }
+  agg->locals = aligned_alloc(sizeof(hm_agg_local_t), (size_t)n_thread * sizeof(hm_agg_local_t));
+  if (agg->locals == NULL) {
+    free(agg);
+    return NULL;
+  }
+  memset(agg->locals, 0, (size_t)n_thread * sizeof(hm_agg_local_t));
+  agg->n_thread = n_thread;
+  agg->hash = hash;
+  agg->cmp = cmp;
+  agg->cache_cap = cache_cap;
+  for (hm_sz_t t = 0; t < n_thread; t++) {
+    hm_agg_local_t* l = &agg->locals[t];
+    l->map = hm_open(hash, cmp);
+    l->cache = cache_cap ? calloc(cache_cap, sizeof(hm_agg_slot_t)) : NULL;
+    if (l->map == NULL || (cache_cap && l->cache == NULL)) {
+      hm_agg_close(agg);
+      return NULL;
+    }
+    l->seed = l->map->seed;
+  }
+  return agg;
+}
+
+hm_t* hm_agg_map(hm_agg_t* agg, hm_sz_t t) {
+  return agg->locals[t].map;
+}
+
+// Adds n to the counter of a key in a private map, whose hash (under the map's seed) is h.
+static int8_t hm_agg_add_hashed(hm_t* map, hm_hash_t h, void* k, hm_sz_t k_sz, uint64_t n) {
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe_hashed(hm_tbl_of_map(map), h, k, k_sz, &found, &n_probe);
+  if (found) {
+    *(uint64_t*)map->items[idx].v += n;
+    return 0;
+  }
+  return hm_put(map, k, k_sz, &n, sizeof(n)) == (hm_sz_t)-1 ? -1 : 0;
+}
+
+// Moves a cached counter into the map. The key changes owners; Only the counter is allocated.
+static int8_t hm_agg_spill(hm_t* map, hm_agg_slot_t* slot) {
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe_hashed(hm_tbl_of_map(map), slot->h, slot->k, slot->k_sz, &found, &n_probe);
+  if (found) {
+    *(uint64_t*)map->items[idx].v += slot->n;
+    free(slot->k);
+    memset(slot, 0, sizeof(hm_agg_slot_t));
+    return 0;
+  }
+  hm_item_t item = {slot->k, slot->k_sz, malloc(sizeof(uint64_t)), sizeof(uint64_t)};
+  if (item.v == NULL || hm_reserve(map, map->sz + 1) != 0) {
+    free(item.v);
+    return -1;
+  }
+  memcpy(item.v, &slot->n, sizeof(uint64_t));
+  if (hm_place(map, slot->h, &item, hm_merge_add_u64, map->cap) < 0) {
+    free(item.v);
+    return -1;
+  }
+  map->sz++;
+  memset(slot, 0, sizeof(hm_agg_slot_t));
+  return 0;
+}
+
+static int8_t hm_agg_flush(hm_agg_t* agg, hm_sz_t t) {
+  hm_agg_local_t* l = &agg->locals[t];
+  for (hm_sz_t i = 0; i < agg->cache_cap; i++) {
+    hm_agg_slot_t* slot = &l->cache[i];
+    if (slot->k == NULL) {
+      continue;
+    }
+    if (l->seed != l->map->seed) {
+      slot->h = l->map->hash(slot->k, slot->k_sz, l->map->seed);
+    }
+    if (hm_agg_spill(l->map, slot) != 0) {
+      return -1;
+    }
+  }
+  l->seed = l->map->seed;
+  return 0;
+}
+
+/*  The counting fast path, which touches nothing shared.
+    With a cache, hot keys are counted in a small direct-mapped table
+    and only a collision spills the resident counter into the map. */
+int8_t hm_agg_add_u64(hm_agg_t* agg, hm_sz_t t, void* k, hm_sz_t k_sz, uint64_t n) {
+  hm_agg_local_t* l = &agg->locals[t];
+  hm_t* map = l->map;
+  // The map was reseeded under the cache, so the cached hashes are stale.
+  if (l->seed != map->seed && hm_agg_flush(agg, t) != 0) {
+    return -1;
+  }
+  hm_hash_t h = map->hash(k, k_sz, map->seed);
+  if (l->cache == NULL) {
+    return hm_agg_add_hashed(map, h, k, k_sz, n);
+  }
+  hm_agg_slot_t* slot = &l->cache[h % agg->cache_cap];
+  if (slot->k != NULL) {
+    if (slot->h == h && map->cmp(slot->k, slot->k_sz, k, k_sz) == 0) {
+      slot->n += n;
+      return 0;
+    }
+    if (hm_agg_spill(map, slot) != 0) {
+      return -1;
+    }
+  }
+  slot->k = malloc(k_sz);
+  if (slot->k == NULL) {
+    return -1;
+  }
+  memcpy(slot->k, k, k_sz);
+  slot->k_sz = k_sz;
+  slot->h = h;
+  slot->n = n;
+  return 0;
+}
+
+// Each thread reports failure in its own slot.
+static void hm_agg_flush_par(void* arg, hm_sz_t t) {
+  hm_agg_t* agg = arg;
+  agg->locals[t].err = hm_agg_flush(agg, t) != 0 ? -1 : 0;
+}
+
+/*  Hands a failed reduce's partial result back to the threads' maps, without allocating.
+    It holds what was merged out of the maps of threads 0 to t. */
+static void hm_agg_unreduce(hm_agg_t* agg, hm_t* map, hm_sz_t t) {
+  hm_agg_local_t* l = &agg->locals[0];
+  if (t > 0) {
+    // Thread 0's map was emptied, so the partial result can take its place.
+    hm_close(l->map);
+    l->map = map;
+    l->seed = map->seed;
+    return;
+  }
+  // All of it came out of thread 0's map, which still has the room it had then.
+  for (hm_sz_t i = 0; i < map->cap; i++) {
+    hm_item_t* item = &map->items[i];
+    if (item->k != NULL) {
+      hm_hash_t h = l->map->hash(item->k, item->k_sz, l->map->seed);
+      l->map->sz += hm_place(l->map, h, item, hm_merge_take_src, l->map->cap);
+    }
+  }
+  map->sz = 0;
+  hm_close(map);
+}
+
+/*  Reduces every private map into one new map, sized once for all of them.
+    Each private map is merged with a partitioned hm_merge_par, and left empty.
+    Pass hm_merge_add_u64 to sum counters.
+    On failure (NULL), every counter is still held by some thread's map, so the
+    reduce may be retried; Which thread's, though, is not kept. */
+hm_t* hm_agg_reduce(hm_agg_t* agg, hm_merge_func resolve, hm_sz_t n_thread) {
+  int8_t err = 0;
+  if (agg->cache_cap) {
+    hm_par(agg->n_thread, hm_agg_flush_par, agg);
+    for (hm_sz_t t = 0; t < agg->n_thread; t++) {
+      err |= agg->locals[t].err;
+    }
+  }
+  hm_t* map = err == 0 ? hm_open(agg->hash, agg->cmp) : NULL;
+  if (map == NULL) {
+    return NULL;
+  }
+  hm_sz_t sz = 0;
+  for (hm_sz_t t = 0; t < agg->n_thread; t++) {
+    sz += agg->locals[t].map->sz;
+  }
+  if (hm_reserve(map, sz) != 0) {
+    hm_close(map);
+    return NULL;
+  }
+  for (hm_sz_t t = 0; t < agg->n_thread; t++) {
+    if (hm_merge_par(map, agg->locals[t].map, resolve, n_thread) != 0) {
+      hm_agg_unreduce(agg, map, t);
+      return NULL;
+    }
+  }
+  return map;
+}
+
+void hm_agg_close(hm_agg_t* agg) {
+  for (hm_sz_t t = 0; t < agg->n_thread; t++) {
+    hm_agg_local_t* l = &agg->locals[t];
+    for (hm_sz_t i = 0; l->cache != NULL && i < agg->cache_cap; i++) {
+      free(l->cache[i].k);
+    }
+    free(l->cache);
+    if (l->map != NULL) {
+      hm_close(l->map);
+    }
+  }
+  free(agg->locals);
+  free(agg);
+}
+
+hm_set_t* hm_set_open(hm_hash_func hash, hm_cmp_func cmp) {
+  hm_set_t* set = calloc(sizeof(hm_set_t), 1);
+  if (set == NULL) {
+    return NULL;
+  }
+  set->items = calloc(HM_INITIAL_CAP, sizeof(hm_key_t));
+  if (set->items == NULL) {
+    free(set);
+    return NULL;
+  }
+  set->cap = HM_INITIAL_CAP;
+  set->hash = hash;
+  set->cmp = cmp;
+  set->seed = hm_seed_next(set);
+  return set;
+}
+
+int8_t hm_set_grow(hm_set_t* set) {
+#ifdef HM_DEBUG
+  set->n_grow++;
+#endif
+  hm_sz_t new_capacity = set->cap * 2;
+  hm_key_t* new_keys = (hm_key_t*)hm_tbl_rehash(hm_tbl_of_set(set), new_capacity);
+  if (new_keys == NULL) {
+    return -1;
+  }
+  free(set->items);
+  set->items = new_keys;
+  set->cap = new_capacity;
+  return 0;
+}
+
+int8_t hm_set_reseed(hm_set_t* set) {
+  hm_hash_t old_seed = set->seed;
+  set->seed = hm_seed_next(set->items) ^ old_seed;
+  hm_key_t* new_keys = (hm_key_t*)hm_tbl_rehash(hm_tbl_of_set(set), set->cap);
+  if (new_keys == NULL) {
+    set->seed = old_seed;
+    return -1;
+  }
+  free(set->items);
+  set->items = new_keys;
+  set->reseed_sz = set->sz;
+#ifdef HM_DEBUG
+  set->n_reseed++;
+#endif
+  return 0;
+}
+
+hm_sz_t hm_set_put(hm_set_t* set, void* k, hm_sz_t k_sz) {
+  if (set->sz >= set->cap * 0.75) {
+    if (hm_set_grow(set) != 0) {
+      return -1;
+    }
+  }
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe(hm_tbl_of_set(set), k, k_sz, &found, &n_probe);
+#ifdef HM_DEBUG
+  set->n_collision += n_probe;
+#endif
+  if (n_probe >= HM_PROBE_LIM && set->sz >= set->reseed_sz * 2) {
+    if (hm_set_reseed(set) != 0) {
+      return -1;
+    }
+    return hm_set_put(set, k, k_sz);
+  }
+  if (found) {
+    return idx;
+  }
+  hm_key_t* key = &set->items[idx];
+  key->k = malloc(k_sz);
+  if (key->k == NULL) {
+    return -1;
+  }
+  memcpy(key->k, k, k_sz);
+  key->k_sz = k_sz;
+  set->sz++;
+  return idx;
+}
+
+int8_t hm_set_has(hm_set_t* set, void* k, hm_sz_t k_sz) {
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_tbl_probe(hm_tbl_of_set(set), k, k_sz, &found, &n_probe);
+#ifdef HM_DEBUG
+  set->n_probe += n_probe;
+#endif
+  return found;
+}
+
+int8_t hm_set_del(hm_set_t* set, void* k, hm_sz_t k_sz) {
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_tbl_t t = hm_tbl_of_set(set);
+  hm_sz_t idx = hm_tbl_probe(t, k, k_sz, &found, &n_probe);
+#ifdef HM_DEBUG
+  set->n_probe += n_probe;
+#endif
+  if (! found) {
+    return 0;
+  }
+  hm_free_owned(set->borrow, set->borrow_sz, set->items[idx].k);
+  hm_tbl_unlink(t, idx);
+  set->sz--;
+  return 1;
+}
+
+void hm_set_close(hm_set_t* set) {
+  for (hm_sz_t i = 0; i < set->cap; i++) {
+    hm_free_owned(set->borrow, set->borrow_sz, set->items[i].k);
+  }
+  free(set->items);
+  if (set->borrow != NULL) {
+    munmap(set->borrow, set->borrow_sz);
+  }
+  free(set);
+}
+
+// Same capacity and seed, so every key lands where it already was.
+static hm_set_t* hm_set_clone(hm_set_t* src) {
+  hm_set_t* set = calloc(sizeof(hm_set_t), 1);
+  if (set == NULL) {
+    return NULL;
+  }
+  *set = *src;
+  set->borrow = NULL;
+  set->borrow_sz = 0;
+  set->items = calloc(src->cap, sizeof(hm_key_t));
+  if (set->items == NULL) {
+    free(set);
+    return NULL;
+  }
+  for (hm_sz_t i = 0; i < src->cap; i++) {
+    if (src->items[i].k != NULL) {
+      set->items[i].k = malloc(src->items[i].k_sz);
+      if (set->items[i].k == NULL) {
+        hm_set_close(set);
+        return NULL;
+      }
+      memcpy(set->items[i].k, src->items[i].k, src->items[i].k_sz);
+      set->items[i].k_sz = src->items[i].k_sz;
+    }
+  }
+  return set;
+}
+
+/*  The set algebra walks the smaller set and probes the larger one.
+    Both sets should agree on what a key is; The result takes its
+    hash and comparison functions from a (or from the clone it starts as). */
+hm_set_t* hm_set_union(hm_set_t* a, hm_set_t* b) {
+  hm_set_t* small = a->sz < b->sz ? a : b;
+  hm_set_t* large = a->sz < b->sz ? b : a;
+  hm_set_t* set = hm_set_clone(large);
+  if (set == NULL) {
+    return NULL;
+  }
+  for (hm_sz_t i = 0; i < small->cap; i++) {
+    if (small->items[i].k != NULL && hm_set_put(set, small->items[i].k, small->items[i].k_sz) == (hm_sz_t)-1) {
+      hm_set_close(set);
+      return NULL;
+    }
+  }
+  return set;
+}
+
+hm_set_t* hm_set_intersect(hm_set_t* a, hm_set_t* b) {
+  hm_set_t* small = a->sz < b->sz ? a : b;
+  hm_set_t* large = a->sz < b->sz ? b : a;
+  hm_set_t* set = hm_set_open(a->hash, a->cmp);
+  if (set == NULL) {
+    return NULL;
+  }
+  for (hm_sz_t i = 0; i < small->cap; i++) {
+    hm_key_t key = small->items[i];
+    if (key.k != NULL && hm_set_has(large, key.k, key.k_sz) && hm_set_put(set, key.k, key.k_sz) == (hm_sz_t)-1) {
+      hm_set_close(set);
+      return NULL;
+    }
+  }
+  return set;
+}
+
+// Keys of a which are not in b.
+hm_set_t* hm_set_diff(hm_set_t* a, hm_set_t* b) {
+  if (b->sz < a->sz) {
+    hm_set_t* set = hm_set_clone(a);
+    if (set == NULL) {
+      return NULL;
+    }
+    for (hm_sz_t i = 0; i < b->cap; i++) {
+      if (b->items[i].k != NULL) {
+        hm_set_del(set, b->items[i].k, b->items[i].k_sz);
+      }
+    }
+    return set;
+  }
+  hm_set_t* set = hm_set_open(a->hash, a->cmp);
+  if (set == NULL) {
+    return NULL;
+  }
+  for (hm_sz_t i = 0; i < a->cap; i++) {
+    hm_key_t key = a->items[i];
+    if (key.k != NULL && ! hm_set_has(b, key.k, key.k_sz) && hm_set_put(set, key.k, key.k_sz) == (hm_sz_t)-1) {
+      hm_set_close(set);
+      return NULL;
+    }
+  }
+  return set;
+}
+
+typedef struct {
+  hm_load_fmt_t fmt;
+  char* base;
+  size_t sz;
+  hm_sz_t n_part;
+  size_t* part_begin;
+  hm_sz_t* part_n;
+  hm_item_t* items;
+  hm_sz_t n;
+  // Set from every chunk's thread.
+  _Atomic int8_t err;
+} hm_load_t;
+
+/*  Reads one line, "k\tv\n". Empty lines come back as an empty item.
+    A borrowed key or value must point inside the mapping even when it is empty,
+    or the map would take it for its own; So an empty value points at its key. */
+static char* hm_load_tsv_line(char* p, char* end, hm_item_t* item) {
+  char* eol = memchr(p, '\n', end - p);
+  eol = eol == NULL ? end : eol;
+  memset(item, 0, sizeof(hm_item_t));
+  if (eol > p) {
+    char* tab = memchr(p, '\t', eol - p);
+    tab = tab == NULL ? eol : tab;
+    item->k = p;
+    item->k_sz = tab - p;
+    item->v = tab + (tab < eol);
+    item->v_sz = eol - (char*)item->v;
+    item->v = item->v_sz ? item->v : item->k;
+  }
+  return eol + (eol < end);
+}
+
+// The first line to start at or after at.
+static size_t hm_load_tsv_sync(hm_load_t* ld, size_t at) {
+  if (at == 0 || at >= ld->sz) {
+    return at == 0 ? 0 : ld->sz;
+  }
+  char* eol = memchr(ld->base + at - 1, '\n', ld->sz - at + 1);
+  return eol == NULL ? ld->sz : (size_t)(eol - ld->base) + 1;
+}
+
+// Counts, then (once items exist) reads, the lines of one chunk.
+static void hm_load_tsv(void* arg, hm_sz_t p) {
+  hm_load_t* ld = arg;
+  char* end = ld->base + ld->part_begin[p + 1];
+  hm_sz_t n = 0;
+  for (char* at = ld->base + ld->part_begin[p]; at < end;) {
+    hm_item_t item;
+    at = hm_load_tsv_line(at, end, &item);
+    if (item.k != NULL) {
+      if (ld->items != NULL) {
+        ld->items[ld->part_n[p] + n] = item;
+      }
+      n++;
+    }
+  }
+  if (ld->items == NULL) {
+    ld->part_n[p] = n;
+  }
+}
+
+static uint32_t hm_load_u32le(char const* p) {
+  uint8_t const* b = (uint8_t const*)p;
+  return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+/*  Walks the length-prefixed records, "<u32le k_sz>k<u32le v_sz>v".
+    Record boundaries are only known by walking from the start, so this is serial.
+    It only touches the length prefixes; The keys and values are read later, in parallel. */
+static int8_t hm_load_bin(hm_load_t* ld) {
+  hm_sz_t n = 0;
+  for (size_t at = 0; at < ld->sz;) {
+    hm_item_t item;
+    if (ld->sz - at < 4) {
+      return -1;
+    }
+    item.k_sz = hm_load_u32le(ld->base + at);
+    item.k = ld->base + at + 4;
+    at += 4 + (size_t)item.k_sz;
+    if (at > ld->sz || ld->sz - at < 4) {
+      return -1;
+    }
+    item.v_sz = hm_load_u32le(ld->base + at);
+    // An empty value at the end would point past the mapping; See hm_load_tsv_line.
+    item.v = item.v_sz ? ld->base + at + 4 : item.k;
+    at += 4 + (size_t)item.v_sz;
+    if (at > ld->sz) {
+      return -1;
+    }
+    if (ld->items != NULL) {
+      ld->items[n] = item;
+    }
+    n++;
+  }
+  ld->n = n;
+  return 0;
+}
+
+// Copies one chunk of the items out of the mapping.
+static void hm_load_copy(void* arg, hm_sz_t p) {
+  hm_load_t* ld = arg;
+  for (hm_sz_t i = (size_t)ld->n * p / ld->n_part; i < (size_t)ld->n * (p + 1) / ld->n_part; i++) {
+    hm_item_t* item = &ld->items[i];
+    void* k = malloc(item->k_sz ? item->k_sz : 1);
+    void* v = malloc(item->v_sz ? item->v_sz : 1);
+    if (k == NULL || v == NULL) {
+      free(k);
+      free(v);
+      ld->err = -1;
+      return;
+    }
+    memcpy(k, item->k, item->k_sz);
+    memcpy(v, item->v, item->v_sz);
+    item->k = k;
+    item->v = v;
+  }
+}
+
+/*  Builds a map from a file of key/value records, in one pass over a mapping of it.
+    Records are split out in parallel chunks (TSV) or by a walk over their length
+    prefixes (binary), and are then inserted by hm_put_moved's partitioned build.
+    With borrow, the map references keys and values inside the mapping, which it
+    keeps until closed. Otherwise they are copied out, and the file is unmapped.
+    When a key is in the file more than once, one of its values wins. */
+hm_t* hm_load(char const* path, hm_load_fmt_t fmt, hm_hash_func hash, hm_cmp_func cmp, int8_t borrow, hm_sz_t n_thread) {
+  hm_load_t ld = {.fmt = fmt, .n_part = n_thread ? n_thread : 1};
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  ld.sz = st.st_size;
+  ld.base = ld.sz ? mmap(NULL, ld.sz, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (ld.sz && ld.base == MAP_FAILED) {
+    return NULL;
+  }
+  if (ld.sz) {
+    madvise(ld.base, ld.sz, MADV_WILLNEED);
+  }
+  hm_t* map = hm_open(hash, cmp);
+  ld.err = map == NULL ? -1 : 0;
+  if (map != NULL && borrow) {
+    map->borrow = ld.base;
+    map->borrow_sz = ld.sz;
+  }
+  if (ld.err == 0 && fmt == HM_LOAD_TSV) {
+    ld.part_begin = calloc(ld.n_part + 1, sizeof(size_t));
+    ld.part_n = calloc(ld.n_part, sizeof(hm_sz_t));
+    ld.err = ld.part_begin == NULL || ld.part_n == NULL ? -1 : 0;
+    for (hm_sz_t p = 1; ld.err == 0 && p <= ld.n_part; p++) {
+      ld.part_begin[p] = hm_load_tsv_sync(&ld, ld.sz * p / ld.n_part);
+    }
+    if (ld.err == 0) {
+      hm_par(ld.n_part, hm_load_tsv, &ld);
+      for (hm_sz_t p = 0; p < ld.n_part; p++) {
+        hm_sz_t n = ld.part_n[p];
+        ld.part_n[p] = ld.n;
+        ld.n += n;
+      }
+    }
+    ld.items = ld.err == 0 ? malloc(((size_t)ld.n + 1) * sizeof(hm_item_t)) : NULL;
+    ld.err = ld.items == NULL ? -1 : 0;
+    if (ld.err == 0) {
+      hm_par(ld.n_part, hm_load_tsv, &ld);
+    }
+  } else if (ld.err == 0) {
+    ld.err = hm_load_bin(&ld);
+    ld.items = ld.err == 0 ? malloc(((size_t)ld.n + 1) * sizeof(hm_item_t)) : NULL;
+    ld.err = ld.items == NULL ? -1 : hm_load_bin(&ld);
+  }
+  if (ld.err == 0 && ! borrow) {
+    hm_par(ld.n_part, hm_load_copy, &ld);
+  }
+  if (ld.err == 0) {
+    ld.err = hm_put_moved(map, ld.items, ld.n, NULL, ld.n_part);
+  }
+  if (ld.err != 0 && ld.items != NULL && ! borrow) {
+    // Some chunks may have been copied before another failed.
+    for (hm_sz_t i = 0; i < ld.n; i++) {
+      if (! hm_is_borrowed(ld.base, ld.sz, ld.items[i].k)) {
+        free(ld.items[i].k);
+        free(ld.items[i].v);
+      }
+    }
+  }
+  free(ld.part_begin);
+  free(ld.part_n);
+  free(ld.items);
+  if ((map == NULL || map->borrow == NULL) && ld.sz) {
+    munmap(ld.base, ld.sz);
+  }
+  if (ld.err != 0 && map != NULL) {
+    // Which unmaps a borrowed mapping.
+    hm_close(map);
+    return NULL;
+  }
+  return map;
+}
+
+/*  Interned strings live in one append-only arena, as "<hm_sz_t k_sz>k" records
+    aligned to the size prefix. A handle is the offset of its record, so it is
+    stable for the pool's lifetime and maps back to its bytes without a lookup.
+    The arena is reserved up front for as many bytes as a handle can address, but
+    inaccessible; It is made writable as it fills, so only that part counts against
+    the commit limit under strict overcommit, and the kernel only backs pages written.
+    The lookup table is a set which borrows its keys from the arena. */
+hm_intern_t* hm_intern_open(void) {
+  hm_intern_t* pool = calloc(sizeof(hm_intern_t), 1);
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->set = hm_set_open(hm_hash_rapidhash, hm_cmp_str);
+  if (pool->set == NULL) {
+    free(pool);
+    return NULL;
+  }
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  size_t arena_cap = sizeof(void*) < 8 ? (size_t)1 << 28 : (size_t)UINT32_MAX + 1;
+  char* arena = mmap(NULL, arena_cap, PROT_NONE, flags, -1, 0);
+  if (arena == MAP_FAILED) {
+    hm_set_close(pool->set);
+    free(pool);
+    return NULL;
+  }
+  pool->set->borrow = arena;
+  pool->set->borrow_sz = arena_cap;
+  return pool;
+}
+
+// Returns k's handle, interning it first if needed. Or -1, when the arena is full.
+hm_sz_t hm_intern(hm_intern_t* pool, void const* k, hm_sz_t k_sz) {
+  hm_set_t* set = pool->set;
+  if (set->sz >= set->cap * 0.75 && hm_set_grow(set) != 0) {
+    return -1;
+  }
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe(hm_tbl_of_set(set), k, k_sz, &found, &n_probe);
+  if (found) {
+    return (hm_sz_t)((char*)set->items[idx].k - sizeof(hm_sz_t) - set->borrow);
+  }
+  if (n_probe >= HM_PROBE_LIM && set->sz >= set->reseed_sz * 2) {
+    if (hm_set_reseed(set) != 0) {
+      return -1;
+    }
+    return hm_intern(pool, k, k_sz);
+  }
+  size_t at = pool->arena_sz;
+  size_t record_sz = (sizeof(hm_sz_t) + (size_t)k_sz + sizeof(hm_sz_t) - 1) & ~(sizeof(hm_sz_t) - 1);
+  if (record_sz > set->borrow_sz - at) {
+    return -1;
+  }
+  if (at + record_sz > pool->arena_cap) {
+    size_t arena_cap = pool->arena_cap ? pool->arena_cap : (size_t)1 << 16;
+    while (arena_cap < at + record_sz) {
+      arena_cap *= 2;
+    }
+    arena_cap = arena_cap < set->borrow_sz ? arena_cap : set->borrow_sz;
+    if (mprotect(set->borrow, arena_cap, PROT_READ | PROT_WRITE) != 0) {
+      return -1;
+    }
+    pool->arena_cap = arena_cap;
+  }
+  memcpy(set->borrow + at, &k_sz, sizeof(hm_sz_t));
+  memcpy(set->borrow + at + sizeof(hm_sz_t), k, k_sz);
+  pool->arena_sz += record_sz;
+  set->items[idx].k = set->borrow + at + sizeof(hm_sz_t);
+  set->items[idx].k_sz = k_sz;
+  set->sz++;
+  return (hm_sz_t)at;
+}
+
+// Returns k's handle, or -1 when k was never interned.
+hm_sz_t hm_intern_find(hm_intern_t* pool, void const* k, hm_sz_t k_sz) {
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe(hm_tbl_of_set(pool->set), k, k_sz, &found, &n_probe);
+  return found ? (hm_sz_t)((char*)pool->set->items[idx].k - sizeof(hm_sz_t) - pool->set->borrow) : (hm_sz_t)-1;
+}
+
+void const* hm_intern_bytes(hm_intern_t* pool, hm_sz_t handle, hm_sz_t* k_sz) {
+  if (handle >= pool->arena_sz) {
+    return NULL;
+  }
+  memcpy(k_sz, pool->set->borrow + handle, sizeof(hm_sz_t));
+  return pool->set->borrow + handle + sizeof(hm_sz_t);
+}
+
+void hm_intern_close(hm_intern_t* pool) {
+  // Which also unmaps the arena.
+  hm_set_close(pool->set);
+  free(pool);
+}
+
+/*  A point-in-time, read-only view of the map.
+    Nothing is copied up front; The live map copies blocks of slots as it
+    goes to change them, so a snapshot costs in proportion to the churn after it.
+    hm_snapshot and hm_snap_close must be serialized with the map's writer.
+    hm_snap_get and hm_snap_item may run alongside a single writer. */
+hm_snap_t* hm_snapshot(hm_t* map) {
+  hm_snap_t* snap = calloc(sizeof(hm_snap_t), 1);
+  if (snap == NULL) {
+    return NULL;
+  }
+  snap->blks = calloc((map->cap + HM_SNAP_BLK - 1) / HM_SNAP_BLK, sizeof(_Atomic(hm_item_t*)));
+  if (snap->blks == NULL) {
+    free(snap);
+    return NULL;
+  }
+  snap->map = map;
+  snap->items = map->items;
+  snap->cap = map->cap;
+  snap->sz = map->sz;
+  snap->hash = map->hash;
+  snap->cmp = map->cmp;
+  snap->seed = map->seed;
+  snap->gen = ++map->snap_gen;
+  snap->next = map->snaps;
+  map->snaps = snap;
+  return snap;
+}
+
+hm_sz_t hm_snap_sz(hm_snap_t const* snap) {
+  return snap->sz;
+}
+
+hm_sz_t hm_snap_cap(hm_snap_t const* snap) {
+  return snap->cap;
+}
+
+/*  The slot at idx, as it was; Walk idx over [0, hm_snap_cap) to export a snapshot.
+    Its read of a live slot races the writer on purpose (see hm_snap_preserve), and
+    ThreadSanitizer, which does not model fences, is told as much. */
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((no_sanitize_thread))
+#endif
+hm_item_t hm_snap_item(hm_snap_t* snap, hm_sz_t idx) {
+  if (idx >= snap->cap) {
+    hm_item_t none;
+    memset(&none, 0, sizeof(hm_item_t));
+    return none;
+  }
+  hm_item_t* blk = atomic_load_explicit(&snap->blks[idx / HM_SNAP_BLK], memory_order_acquire);
+  if (blk != NULL) {
+    return blk[idx % HM_SNAP_BLK];
+  }
+  hm_item_t item = snap->items[idx];
+  // If the writer copied the block while we read, our read may be torn; Use the copy.
+  atomic_thread_fence(memory_order_acquire);
+  blk = atomic_load_explicit(&snap->blks[idx / HM_SNAP_BLK], memory_order_relaxed);
+  return blk != NULL ? blk[idx % HM_SNAP_BLK] : item;
+}
+
+hm_item_t hm_snap_get(hm_snap_t* snap, void* k, hm_sz_t k_sz) {
+  hm_sz_t idx = snap->hash(k, k_sz, snap->seed) % snap->cap;
+  while (1) {
+    hm_item_t item = hm_snap_item(snap, idx);
+    if (item.k == NULL) {
+      return item;
+    }
+    if (snap->cmp(item.k, item.k_sz, k, k_sz) == 0) {
+      return item;
+    }
+    idx = (idx + 1) % snap->cap;
+  }
+}
+
+void hm_snap_close(hm_snap_t* snap) {
+  hm_t* map = snap->map;
+  for (hm_snap_t** at = &map->snaps; *at != NULL; at = &(*at)->next) {
+    if (*at == snap) {
+      *at = snap->next;
+      break;
+    }
+  }
+  for (hm_sz_t blk = 0; blk * HM_SNAP_BLK < snap->cap; blk++) {
+    free(snap->blks[blk]);
+  }
+  free(snap->blks);
+  free(snap);
+  // What was let go of before the oldest open snapshot was taken is no one's now.
+  hm_sz_t oldest_gen = map->snap_gen + 1;
+  for (hm_snap_t* open = map->snaps; open != NULL; open = open->next) {
+    oldest_gen = open->gen < oldest_gen ? open->gen : oldest_gen;
+  }
+  size_t n_dead = 0;
+  for (size_t i = 0; i < map->n_dead; i++) {
+    if (map->dead[i].gen < oldest_gen) {
+      free(map->dead[i].p);
+    } else {
+      map->dead[n_dead++] = map->dead[i];
+    }
+  }
+  map->n_dead = n_dead;
+  if (map->snaps == NULL) {
+    free(map->dead);
+    map->dead = NULL;
+    map->dead_cap = 0;
+  }
+}
+
+/*  A spilled record is "<k_sz><v_sz>kv", sizes in native order.
+    The segment is scratch space for this process only, and is unlinked as soon as it is open.
+    It must not exist beforehand; O_EXCL also refuses to follow a symlink planted at path. */
+typedef struct {
+  uint32_t k_sz;
+  uint32_t v_sz;
+} hm_tier_hdr_t;
+
+static int hm_tier_segment(char const* path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  return fd;
+}
+
+// What a hot entry counts against the budget.
+static size_t hm_tier_cost(hm_sz_t k_sz, hm_sz_t v_sz) {
+  return sizeof(hm_item_t) + k_sz + v_sz;
+}
+
+/*  Reference bits are kept per hot slot, and are all cleared when the hot map grows.
+    Entries moved by a reseed or a deletion may carry the wrong bit for a sweep,
+    which only makes the policy less exact. So does running out of memory for new bits. */
+static void hm_tier_mark(hm_tier_t* tier, hm_sz_t idx) {
+  if (tier->refs_cap != tier->hot->cap) {
+    uint8_t* refs = calloc(tier->hot->cap, 1);
+    if (refs != NULL) {
+      free(tier->refs);
+      tier->refs = refs;
+      tier->refs_cap = tier->hot->cap;
+    }
+  }
+  if (idx < tier->refs_cap) {
+    tier->refs[idx] = 1;
+  }
+}
+
+static hm_hash_t hm_tier_fp(hm_tier_t* tier, void const* k, hm_sz_t k_sz) {
+  hm_hash_t fp = tier->hot->hash(k, k_sz, tier->seed);
+  // Zero marks an empty index slot.
+  return fp != 0 ? fp : 1;
+}
+
+static void hm_tier_index_place(hm_tier_ref_t* index, hm_sz_t cap, hm_tier_ref_t ref) {
+  hm_sz_t idx = ref.fp % cap;
+  while (index[idx].fp != 0) {
+    idx = (idx + 1) % cap;
+  }
+  index[idx] = ref;
+}
+
+static int8_t hm_tier_index_put(hm_tier_t* tier, hm_tier_ref_t ref) {
+  if (tier->index_sz >= tier->index_cap * 0.75) {
+    hm_sz_t cap = tier->index_cap * 2;
+    hm_tier_ref_t* index = calloc(cap, sizeof(hm_tier_ref_t));
+    if (index == NULL) {
+      return -1;
+    }
+    for (hm_sz_t i = 0; i < tier->index_cap; i++) {
+      if (tier->index[i].fp != 0) {
+        hm_tier_index_place(index, cap, tier->index[i]);
+      }
+    }
+    free(tier->index);
+    tier->index = index;
+    tier->index_cap = cap;
+  }
+  hm_tier_index_place(tier->index, tier->index_cap, ref);
+  tier->index_sz++;
+  return 0;
+}
+
+// Drops a spilled record from the index, with the same backward shift as maps use.
+static void hm_tier_drop(hm_tier_t* tier, hm_tier_ref_t ref, hm_tier_hdr_t hdr) {
+  hm_sz_t cap = tier->index_cap;
+  hm_sz_t idx = ref.fp % cap;
+  while (tier->index[idx].fp != ref.fp || tier->index[idx].off != ref.off) {
+    idx = (idx + 1) % cap;
+  }
+  memset(&tier->index[idx], 0, sizeof(hm_tier_ref_t));
+  hm_sz_t next_idx = idx;
+  while (1) {
+    next_idx = (next_idx + 1) % cap;
+    if (tier->index[next_idx].fp == 0) {
+      break;
+    }
+    hm_sz_t natural_idx = tier->index[next_idx].fp % cap;
+    int8_t is_after_hole = idx <= next_idx ? (idx < natural_idx && natural_idx <= next_idx)
+                                           : (idx < natural_idx || natural_idx <= next_idx);
+    if (is_after_hole) {
+      continue;
+    }
+    tier->index[idx] = tier->index[next_idx];
+    memset(&tier->index[next_idx], 0, sizeof(hm_tier_ref_t));
+    idx = next_idx;
+  }
+  tier->index_sz--;
+  tier->log_dead += sizeof(hm_tier_hdr_t) + hdr.k_sz + hdr.v_sz;
+}
+
+/*  Finds k's spilled record. Returns 1 if found, 0 if not, and -1 on a failed read.
+    Fingerprints can collide, so each candidate's key is read back and compared. */
+static int8_t hm_tier_find(hm_tier_t* tier, void* k, hm_sz_t k_sz, hm_tier_ref_t* ref, hm_tier_hdr_t* hdr) {
+  hm_hash_t fp = hm_tier_fp(tier, k, k_sz);
+  char* stored_k = NULL;
+  int8_t r = 0;
+  for (hm_sz_t idx = fp % tier->index_cap; tier->index[idx].fp != 0; idx = (idx + 1) % tier->index_cap) {
+    if (tier->index[idx].fp != fp) {
+      continue;
+    }
+    if (stored_k == NULL && (stored_k = malloc(k_sz ? k_sz : 1)) == NULL) {
+      r = -1;
+      break;
+    }
+    struct iovec iov[2] = {{hdr, sizeof(hm_tier_hdr_t)}, {stored_k, k_sz}};
+    ssize_t n = preadv(tier->fd, iov, 2, tier->index[idx].off);
+    if (n < (ssize_t)sizeof(hm_tier_hdr_t)) {
+      r = -1;
+      break;
+    }
+    if (hdr->k_sz == k_sz && tier->hot->cmp(stored_k, k_sz, k, k_sz) == 0) {
+      *ref = tier->index[idx];
+      r = 1;
+      break;
+    }
+  }
+  free(stored_k);
+  return r;
+}
+
+// Spills the first hot entry under the clock hand which was not used since the hand last passed.
+static int8_t hm_tier_spill(hm_tier_t* tier) {
+  hm_t* hot = tier->hot;
+  hm_sz_t idx;
+  while (1) {
+    idx = tier->hand % hot->cap;
+    tier->hand = (idx + 1) % hot->cap;
+    if (hot->items[idx].k == NULL) {
+      continue;
+    }
+    if (idx < tier->refs_cap && tier->refs[idx]) {
+      tier->refs[idx] = 0;
+      continue;
+    }
+    break;
+  }
+  hm_item_t item = hot->items[idx];
+  hm_tier_hdr_t hdr = {item.k_sz, item.v_sz};
+  struct iovec iov[3] = {{&hdr, sizeof(hdr)}, {item.k, item.k_sz}, {item.v, item.v_sz}};
+  size_t rec_sz = sizeof(hdr) + item.k_sz + item.v_sz;
+  if (pwritev(tier->fd, iov, 3, tier->log_sz) != (ssize_t)rec_sz) {
+    return -1;
+  }
+  hm_tier_ref_t ref = {hm_tier_fp(tier, item.k, item.k_sz), tier->log_sz};
+  if (hm_tier_index_put(tier, ref) != 0) {
+    return -1;
+  }
+  tier->log_sz += rec_sz;
+  tier->hot_bytes -= hm_tier_cost(item.k_sz, item.v_sz);
+  hm_del(hot, item.k, item.k_sz);
+#ifdef HM_DEBUG
+  tier->n_spill++;
+#endif
+  return 0;
+}
+
+// Spills until the hot map has room for extra bytes, is empty, or a spill fails.
+static void hm_tier_fit(hm_tier_t* tier, size_t extra) {
+  while (tier->hot->sz > 0 && tier->hot_bytes + extra > tier->budget) {
+    if (hm_tier_spill(tier) != 0) {
+      return;
+    }
+  }
+}
+
+/*  Promotions, overwrites and deletions leave dead records behind.
+    Once they are half the segment, the live records are copied to a fresh one,
+    so each live byte is copied at most once per byte which died.
+    If that fails, the old segment stays in use, which is still correct. */
+static void hm_tier_compact(hm_tier_t* tier) {
+  if (tier->log_dead < HM_TIER_COMPACT_MIN || tier->log_dead * 2 < tier->log_sz) {
+    return;
+  }
+  int fd = hm_tier_segment(tier->path);
+  uint64_t* offs = malloc((tier->index_sz + 1) * sizeof(uint64_t));
+  char* buf = NULL;
+  size_t buf_cap = 0;
+  uint64_t log_sz = 0;
+  int8_t ok = fd >= 0 && offs != NULL;
+  for (hm_sz_t i = 0, j = 0; ok && i < tier->index_cap; i++) {
+    if (tier->index[i].fp == 0) {
+      continue;
+    }
+    hm_tier_hdr_t hdr;
+    ok = pread(tier->fd, &hdr, sizeof(hdr), tier->index[i].off) == sizeof(hdr);
+    size_t rec_sz = sizeof(hdr) + (size_t)hdr.k_sz + hdr.v_sz;
+    if (ok && rec_sz > buf_cap) {
+      char* grown = realloc(buf, rec_sz);
+      ok = grown != NULL;
+      buf = ok ? grown : buf;
+      buf_cap = ok ? rec_sz : buf_cap;
+    }
+    ok = ok && pread(tier->fd, buf, rec_sz, tier->index[i].off) == (ssize_t)rec_sz;
+    ok = ok && pwrite(fd, buf, rec_sz, log_sz) == (ssize_t)rec_sz;
+    offs[j++] = log_sz;
+    log_sz += rec_sz;
+  }
+  free(buf);
+  if (! ok) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(offs);
+    return;
+  }
+  // Nothing points into the new segment until every record made it there.
+  for (hm_sz_t i = 0, j = 0; i < tier->index_cap; i++) {
+    if (tier->index[i].fp != 0) {
+      tier->index[i].off = offs[j++];
+    }
+  }
+  free(offs);
+  close(tier->fd);
+  tier->fd = fd;
+  tier->log_sz = log_sz;
+  tier->log_dead = 0;
+#ifdef HM_DEBUG
+  tier->n_compact++;
+#endif
+}
+
+/*  A map of at most about budget bytes in memory, spilling to a segment at path.
+    Keys are fingerprinted under a seed of their own, so the hot map can reseed freely. */
+hm_tier_t* hm_tier_open(char const* path, size_t budget, hm_hash_func hash, hm_cmp_func cmp) {
+  hm_tier_t* tier = calloc(sizeof(hm_tier_t), 1);
+  if (tier == NULL) {
+    return NULL;
+  }
+  tier->fd = -1;
+  tier->hot = hm_open(hash, cmp);
+  tier->path = strdup(path);
+  tier->index = calloc(HM_INITIAL_CAP, sizeof(hm_tier_ref_t));
+  if (tier->hot == NULL || tier->path == NULL || tier->index == NULL || (tier->fd = hm_tier_segment(path)) < 0) {
+    hm_tier_close(tier);
+    return NULL;
+  }
+  tier->index_cap = HM_INITIAL_CAP;
+  tier->budget = budget;
+  tier->seed = hm_seed_next(tier);
+  return tier;
+}
+
+/*  The tier's writes return -1 only when they changed nothing.
+    Once a write is done, failing to spill or compact after it is not an error;
+    The hot map stays over budget (or the segment uncompacted) until a later write manages. */
+int8_t hm_tier_put(hm_tier_t* tier, void* k, hm_sz_t k_sz, void* v, hm_sz_t v_sz) {
+  hm_item_t old = hm_get(tier->hot, k, k_sz);
+  // The key may have been spilled before, and that copy goes stale.
+  hm_tier_ref_t ref;
+  hm_tier_hdr_t hdr;
+  int8_t found = old.k == NULL && tier->index_sz > 0 ? hm_tier_find(tier, k, k_sz, &ref, &hdr) : 0;
+  if (found < 0) {
+    return -1;
+  }
+  hm_sz_t idx = hm_put(tier->hot, k, k_sz, v, v_sz);
+  if (idx == (hm_sz_t)-1) {
+    return -1;
+  }
+  if (found) {
+    hm_tier_drop(tier, ref, hdr);
+  }
+  tier->hot_bytes -= old.k != NULL ? hm_tier_cost(old.k_sz, old.v_sz) : 0;
+  tier->hot_bytes += hm_tier_cost(k_sz, v_sz);
+  hm_tier_mark(tier, idx);
+  hm_tier_fit(tier, 0);
+  hm_tier_compact(tier);
+  return 0;
+}
+
+/*  Looks in the hot map, then in the segment. A spilled entry is read back and promoted,
+    so the item returned always lives in the hot map. It stays valid until the tier next changes.
+    Sets status to 1 if found, 0 if not, and -1 when the entry could not be read or promoted;
+    It may still be in the segment then, so an empty item does not mean the key is absent. */
+hm_item_t hm_tier_get(hm_tier_t* tier, void* k, hm_sz_t k_sz, int8_t* status) {
+  hm_item_t none;
+  memset(&none, 0, sizeof(hm_item_t));
+  *status = -1;
+  hm_t* hot = tier->hot;
+  int8_t found;
+  hm_sz_t n_probe;
+  hm_sz_t idx = hm_tbl_probe(hm_tbl_of_map(hot), k, k_sz, &found, &n_probe);
+#ifdef HM_DEBUG
+  hot->n_probe += n_probe;
+#endif
+  if (found) {
+    if (idx < tier->refs_cap) {
+      tier->refs[idx] = 1;
+    }
+    *status = 1;
+    return hot->items[idx];
+  }
+  hm_tier_ref_t ref;
+  hm_tier_hdr_t hdr;
+  found = tier->index_sz > 0 ? hm_tier_find(tier, k, k_sz, &ref, &hdr) : 0;
+  if (found != 1) {
+    *status = found;
+    return none;
+  }
+  void* v = malloc(hdr.v_sz ? hdr.v_sz : 1);
+  if (v == NULL || pread(tier->fd, v, hdr.v_sz, ref.off + sizeof(hdr) + k_sz) != (ssize_t)hdr.v_sz) {
+    free(v);
+    return none;
+  }
+  // Room is made first, so the promoted entry cannot be what gets spilled.
+  // The record stays indexed until the entry is safely hot.
+  hm_tier_fit(tier, hm_tier_cost(k_sz, hdr.v_sz));
+  idx = hm_put(hot, k, k_sz, v, hdr.v_sz);
+  free(v);
+  if (idx == (hm_sz_t)-1) {
+    return none;
+  }
+  hm_tier_drop(tier, ref, hdr);
+  tier->hot_bytes += hm_tier_cost(k_sz, hdr.v_sz);
+  hm_tier_mark(tier, idx);
+#ifdef HM_DEBUG
+  tier->n_promote++;
+#endif
+  hm_tier_compact(tier);
+  *status = 1;
+  return hot->items[idx];
+}
+
+int8_t hm_tier_del(hm_tier_t* tier, void* k, hm_sz_t k_sz) {
+  hm_item_t old = hm_get(tier->hot, k, k_sz);
+  if (old.k != NULL) {
+    size_t cost = hm_tier_cost(old.k_sz, old.v_sz);
+    int8_t r = hm_del(tier->hot, k, k_sz);
+    tier->hot_bytes -= r == 1 ? cost : 0;
+    return r;
+  }
+  if (tier->index_sz == 0) {
+    return 0;
+  }
+  hm_tier_ref_t ref;
+  hm_tier_hdr_t hdr;
+  int8_t found = hm_tier_find(tier, k, k_sz, &ref, &hdr);
+  if (found != 1) {
+    return found;
+  }
+  hm_tier_drop(tier, ref, hdr);
+  hm_tier_compact(tier);
+  return 1;
+}
+
+void hm_tier_close(hm_tier_t* tier) {
+  if (tier->hot != NULL) {
+    hm_close(tier->hot);
+  }
+  if (tier->fd >= 0) {
+    close(tier->fd);
+  }
+  free(tier->path);
+  free(tier->refs);
+  free(tier->index);
+  free(tier);
+}
@@ -0,0 +1,121 @@
+#include "salmagundi-perf.h"
+#include "salmagundi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t xorshift(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Fills keys with n distinct values. Hits are the even ones, so a miss is a key | 1.
+static uint64_t* make_keys(size_t n, uint64_t seed) {
+  uint64_t* keys = malloc(n * sizeof(uint64_t));
+  for (size_t i = 0; i < n; i++) { keys[i] = (xorshift(&seed) & ~1ull) ^ (i << 1); }
+  return keys;
+}
+
+static void shuffle(uint64_t* keys, size_t n, uint64_t seed) {
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = xorshift(&seed) % (i + 1);
+    uint64_t swap = keys[i];
+    keys[i] = keys[j];
+    keys[j] = swap;
+  }
+}
+
+// Keeps a result alive, so that the measured loops are not optimized out.
+static volatile uint64_t sink;
+
+static void bench(hm_perf_t* perf, hm_hash_func hash, char const* hash_name, size_t n) {
+  char name[64];
+  uint64_t* keys = make_keys(n, 0x2545f4914f6cdd1dull);
+  hm_t* map = hm_open(hash, hm_cmp_str);
+
+  hm_perf_begin(perf);
+  for (size_t i = 0; i < n; i++) { hm_put(map, &keys[i], sizeof(uint64_t), &keys[i], sizeof(uint64_t)); }
+  hm_perf_end(perf);
+  snprintf(name, sizeof(name), "%s put", hash_name);
+  hm_perf_report(perf, name, n, stdout);
+
+  shuffle(keys, n, 0x9e3779b97f4a7c15ull);
+  uint64_t n_hit = 0;
+  hm_perf_begin(perf);
+  for (size_t i = 0; i < n; i++) { n_hit += hm_get(map, &keys[i], sizeof(uint64_t)).k != NULL; }
+  hm_perf_end(perf);
+  sink = n_hit;
+  snprintf(name, sizeof(name), "%s get hit", hash_name);
+  hm_perf_report(perf, name, n, stdout);
+
+  void** ks = malloc(n * sizeof(void*));
+  hm_sz_t* k_szs = malloc(n * sizeof(hm_sz_t));
+  hm_item_t* out = malloc(n * sizeof(hm_item_t));
+  for (size_t i = 0; i < n; i++) {
+    ks[i] = &keys[i];
+    k_szs[i] = sizeof(uint64_t);
+  }
+  hm_perf_begin(perf);
+  hm_get_n(map, ks, k_szs, n, out);
+  hm_perf_end(perf);
+  sink = (uint64_t)(uintptr_t)out[n - 1].k;
+  snprintf(name, sizeof(name), "%s get_n hit", hash_name);
+  hm_perf_report(perf, name, n, stdout);
+  free(ks);
+  free(k_szs);
+  free(out);
+
+  for (size_t i = 0; i < n; i++) { keys[i] |= 1; }
+  uint64_t n_miss = 0;
+  hm_perf_begin(perf);
+  for (size_t i = 0; i < n; i++) { n_miss += hm_get(map, &keys[i], sizeof(uint64_t)).k == NULL; }
+  hm_perf_end(perf);
+  sink = n_miss;
+  snprintf(name, sizeof(name), "%s get miss", hash_name);
+  hm_perf_report(perf, name, n, stdout);
+
+  // Per item moved, rather than per call.
+  hm_perf_begin(perf);
+  hm_grow(map);
+  hm_perf_end(perf);
+  snprintf(name, sizeof(name), "%s grow", hash_name);
+  hm_perf_report(perf, name, map->sz, stdout);
+
+  for (size_t i = 0; i < n; i++) { keys[i] &= ~1ull; }
+  hm_perf_begin(perf);
+  for (size_t i = 0; i < n; i++) { hm_del(map, &keys[i], sizeof(uint64_t)); }
+  hm_perf_end(perf);
+  snprintf(name, sizeof(name), "%s del", hash_name);
+  hm_perf_report(perf, name, n, stdout);
+
+  hm_close(map);
+  free(keys);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2) {
+    printf("%s takes at most one argument, the number of keys.\n", argv[0]);
+    return 1;
+  }
+  size_t n = argc == 2 ? strtoull(argv[1], NULL, 10) : 1 << 20;
+  if (n == 0) {
+    printf("%s needs at least one key.\n", argv[0]);
+    return 1;
+  }
+  hm_perf_t* perf = hm_perf_open();
+  if (perf == NULL) {
+    return 1;
+  }
+  for (int c = 0; c < HM_PERF_N; c++) {
+    if (! hm_perf_has(perf, c)) {
+      fprintf(stderr, "Some hardware counters are unavailable; They are reported as n/a.\n");
+      break;
+    }
+  }
+  bench(perf, hm_hash_rapidhash, "rapidhash", n);
+  bench(perf, hm_hash_djb1, "djb1", n);
+  hm_perf_close(perf);
+  return 0;
+}
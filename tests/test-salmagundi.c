@@ -1,5 +1,6 @@
 #include "salmagundi.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdio.h>
@@ -33,8 +34,8 @@ void test_hm_of_int_int(void) {
   int v = 2;
   hm_put(map, &k, sizeof(k), &v, sizeof(v));
   assert(map->sz == 1);
-  assert(*(int*)map->items[hm_hash_byte(&k, sizeof(k))].k == k);
-  assert(*(int*)map->items[hm_hash_byte(&k, sizeof(k))].v == v);
+  assert(*(int*)map->items[hm_hash_byte(&k, sizeof(k), map->seed)].k == k);
+  assert(*(int*)map->items[hm_hash_byte(&k, sizeof(k), map->seed)].v == v);
   hm_item_t result = hm_get(map, &k, sizeof(k));
   assert(*(int*)result.k == k);
   hm_close(map);
@@ -49,7 +50,7 @@ void test_hm_of_str_str(void) {
   uint64_t idx = hm_put(map, k, k_sz, v, v_sz);
   assert(idx < map->cap);
   assert(idx >= 0);
-  assert(idx == hm_hash_djb1(k, k_sz) % map->cap);
+  assert(idx == hm_hash_djb1(k, k_sz, map->seed) % map->cap);
   assert(map->sz == 1);
   assert(memcmp(map->items[idx].k, k, k_sz) == 0);
   assert(memcmp(map->items[idx].v, v, v_sz) == 0);
@@ -99,7 +100,7 @@ void dump_map_str_str_items(hm_t* map) {
     if (map->items[i].k != NULL) {
       char* k = map->items[i].k;
       char* v = map->items[i].v;
-      hm_sz_t hash = map->hash(k, map->items[i].k_sz);
+      hm_sz_t hash = map->hash(k, map->items[i].k_sz, map->seed);
       char v_owned[map->items[i].v_sz + 1];
       memset(v_owned, 0, sizeof(v_owned));
       memcpy(v_owned, v, map->items[i].v_sz);
@@ -174,12 +175,18 @@ void test_hm_torture_high_collision_rate(void) {
   test_hm_torture(HIGH_COLLISION_RATE, hm_hash_rapidhash);
 }
 
-hm_hash_t hash_always_collide_func(void const* k, hm_sz_t k_sz) {
+hm_hash_t hash_always_collide_func(void const* k, hm_sz_t k_sz, hm_hash_t seed) {
   (void)k;
   (void)k_sz;
+  (void)seed;
   return 0;
 }
 
+// Collides everything under a zero seed, and behaves under any other.
+hm_hash_t hash_collide_unseeded_func(void const* k, hm_sz_t k_sz, hm_hash_t seed) {
+  return seed == 0 ? 0 : hm_hash_rapidhash(k, k_sz, seed);
+}
+
 // For a map with three colliding keys, k1..3,
 // if the entry at k2 is deleted, the entry at k3 should be accessible.
 void test_hm_deleted_colliding_keys() {
@@ -204,17 +211,573 @@ void test_hm_deleted_colliding_keys() {
   hm_close(map);
 }
 
+void test_hm_seeds_differ(void) {
+  hm_t* a = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  hm_t* b = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  assert(a->seed != b->seed);
+  char* k = "k";
+  assert(hm_hash_rapidhash(k, strlen(k), a->seed) != hm_hash_rapidhash(k, strlen(k), b->seed));
+  hm_close(a);
+  hm_close(b);
+}
+
+// A long probe run during a put should reseed the map and rehash it
+// into a layout where every key is still reachable.
+void test_hm_reseed_on_long_probe(void) {
+  hm_t* map = hm_open(hash_collide_unseeded_func, hm_cmp_str);
+  map->seed = 0;
+  hm_sz_t n = HM_PROBE_LIM * 4;
+  for (hm_sz_t i = 0; i < n; i++) {
+    hm_put(map, &i, sizeof(i), &i, sizeof(i));
+  }
+  assert(map->sz == n);
+  assert(map->seed != 0);
+  assert(map->n_reseed == 1);
+  map->n_probe = 0;
+  for (hm_sz_t i = 0; i < n; i++) {
+    hm_item_t itm = hm_get(map, &i, sizeof(i));
+    assert(itm.k != NULL);
+    assert(*(hm_sz_t*)itm.v == i);
+  }
+  assert(map->n_probe < n * 2);
+  hm_print_hm_detail(map);
+  hm_close(map);
+}
+
+// Deleting the head of a run should shift the whole run back, not just its next slot.
+void test_hm_deleted_colliding_head(void) {
+  hm_t* map = hm_open(hash_always_collide_func, hm_cmp_str);
+  char* ks[] = {"k1", "k2", "k3", "k4"};
+  char* v = "v";
+  for (int i = 0; i < 4; i++) {
+    hm_put(map, ks[i], strlen(ks[i]), v, strlen(v));
+  }
+  hm_del(map, ks[0], strlen(ks[0]));
+  assert(map->sz == 3);
+  for (int i = 1; i < 4; i++) {
+    assert(hm_get(map, ks[i], strlen(ks[i])).k != NULL);
+  }
+  hm_close(map);
+}
+
+// A run of 0, 1, 0 (by natural index): Deleting the first 0 must not strand the second one
+// behind the 1, which is already at its natural index.
+void test_hm_deleted_interleaved_keys(void) {
+  hm_t* map = hm_open(hm_hash_byte, hm_cmp_str);
+  char* ks[] = {"\x00a", "\x01b", "\x00c"};
+  char* v = "v";
+  for (int i = 0; i < 3; i++) {
+    hm_put(map, ks[i], 2, v, strlen(v));
+  }
+  hm_del(map, ks[0], 2);
+  assert(hm_get(map, ks[1], 2).k != NULL);
+  assert(hm_get(map, ks[2], 2).k != NULL);
+  hm_close(map);
+}
+
+void test_hm_set(void) {
+  hm_set_t* set = hm_set_open(hm_hash_rapidhash, hm_cmp_str);
+  assert(sizeof(set->items[0]) < sizeof(hm_item_t));
+  char* k = "k";
+  assert(hm_set_has(set, k, strlen(k)) == 0);
+  hm_sz_t idx = hm_set_put(set, k, strlen(k));
+  assert(idx < set->cap);
+  assert(hm_set_put(set, k, strlen(k)) == idx);
+  assert(set->sz == 1);
+  assert(hm_set_has(set, k, strlen(k)) == 1);
+  assert(hm_set_del(set, k, strlen(k)) == 1);
+  assert(hm_set_del(set, k, strlen(k)) == 0);
+  assert(hm_set_has(set, k, strlen(k)) == 0);
+  assert(set->sz == 0);
+  for (hm_sz_t i = 0; i < HM_INITIAL_CAP * 4; i++) {
+    hm_set_put(set, &i, sizeof(i));
+  }
+  assert(set->sz == HM_INITIAL_CAP * 4);
+  assert(set->n_grow > 0);
+  for (hm_sz_t i = 0; i < HM_INITIAL_CAP * 4; i++) {
+    assert(hm_set_has(set, &i, sizeof(i)));
+  }
+  hm_set_close(set);
+}
+
+// a = [0, 3000), b = [2000, 2500)
+void test_hm_set_algebra(void) {
+  hm_set_t* a = hm_set_open(hm_hash_rapidhash, hm_cmp_str);
+  hm_set_t* b = hm_set_open(hm_hash_rapidhash, hm_cmp_str);
+  for (hm_sz_t i = 0; i < 3000; i++) {
+    hm_set_put(a, &i, sizeof(i));
+  }
+  for (hm_sz_t i = 2000; i < 2500; i++) {
+    hm_set_put(b, &i, sizeof(i));
+  }
+  hm_set_t* u = hm_set_union(b, a);
+  hm_set_t* n = hm_set_intersect(a, b);
+  hm_set_t* a_b = hm_set_diff(a, b);
+  hm_set_t* b_a = hm_set_diff(b, a);
+  assert(u->sz == 3000);
+  assert(n->sz == 500);
+  assert(a_b->sz == 2500);
+  assert(b_a->sz == 0);
+  for (hm_sz_t i = 0; i < 3000; i++) {
+    int8_t in_b = i >= 2000 && i < 2500;
+    assert(hm_set_has(u, &i, sizeof(i)));
+    assert(hm_set_has(n, &i, sizeof(i)) == in_b);
+    assert(hm_set_has(a_b, &i, sizeof(i)) == ! in_b);
+  }
+  hm_set_close(u);
+  hm_set_close(n);
+  hm_set_close(a_b);
+  hm_set_close(b_a);
+  hm_set_close(a);
+  hm_set_close(b);
+}
+
+void merge_add_int(hm_item_t* dst, hm_item_t* src) {
+  *(int*)dst->v += *(int*)src->v;
+}
+
+// dst holds [0, n) -> 1, and src holds [n / 2, n * 3 / 2) -> 2.
+void check_hm_merge(hm_sz_t n_thread) {
+  hm_sz_t n = HM_INITIAL_CAP * 16;
+  hm_t* dst = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  hm_t* src = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  for (hm_sz_t i = 0; i < n; i++) {
+    int v = 1;
+    hm_put(dst, &i, sizeof(i), &v, sizeof(v));
+  }
+  for (hm_sz_t i = n / 2; i < n * 3 / 2; i++) {
+    int v = 2;
+    hm_put(src, &i, sizeof(i), &v, sizeof(v));
+  }
+  hm_item_t moved = hm_get(src, &n, sizeof(n));
+  dst->n_grow = 0;
+  assert(hm_merge_par(dst, src, merge_add_int, n_thread) == 0);
+  assert(dst->n_grow <= 1);
+  assert(src->sz == 0);
+  assert(hm_get(src, &n, sizeof(n)).k == NULL);
+  assert(hm_get(dst, &n, sizeof(n)).k == moved.k);
+  assert(dst->sz == n * 3 / 2);
+  for (hm_sz_t i = 0; i < n * 3 / 2; i++) {
+    hm_item_t itm = hm_get(dst, &i, sizeof(i));
+    assert(itm.k != NULL);
+    assert(*(int*)itm.v == (i < n / 2 ? 1 : i < n ? 3 : 2));
+  }
+  hm_close(src);
+  hm_close(dst);
+}
+
+void test_hm_merge(void) {
+  check_hm_merge(1);
+  check_hm_merge(4);
+  hm_t* dst = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  hm_t* src = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  char* k = "k";
+  hm_put(dst, k, strlen(k), "dst", 3);
+  hm_put(src, k, strlen(k), "src", 3);
+  hm_merge(dst, src, NULL);
+  assert(memcmp(hm_get(dst, k, strlen(k)).v, "src", 3) == 0);
+  hm_close(src);
+  hm_close(dst);
+}
+
+typedef struct {
+  hm_agg_t* agg;
+  hm_sz_t t;
+} agg_job_t;
+
+// Each thread counts keys [0, 4096) (mod 64 for half of the adds, to keep some hot).
+void* agg_job_run(void* arg) {
+  agg_job_t* job = arg;
+  for (hm_sz_t i = 0; i < 4096; i++) {
+    hm_sz_t k = i;
+    hm_agg_add_u64(job->agg, job->t, &k, sizeof(k), 1);
+    k = i % 64;
+    hm_agg_add_u64(job->agg, job->t, &k, sizeof(k), 1);
+  }
+  return NULL;
+}
+
+void check_hm_agg(hm_sz_t cache_cap) {
+  hm_sz_t n_thread = 4;
+  hm_agg_t* agg = hm_agg_open(n_thread, hm_hash_rapidhash, hm_cmp_str, cache_cap);
+  pthread_t threads[n_thread];
+  agg_job_t jobs[n_thread];
+  for (hm_sz_t t = 0; t < n_thread; t++) {
+    jobs[t] = (agg_job_t){agg, t};
+    pthread_create(&threads[t], NULL, agg_job_run, &jobs[t]);
+  }
+  for (hm_sz_t t = 0; t < n_thread; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  hm_t* map = hm_agg_reduce(agg, hm_merge_add_u64, n_thread);
+  assert(map->sz == 4096);
+  for (hm_sz_t i = 0; i < 4096; i++) {
+    hm_item_t itm = hm_get(map, &i, sizeof(i));
+    assert(itm.k != NULL);
+    assert(*(uint64_t*)itm.v == n_thread * (i < 64 ? 65 : 1));
+  }
+  for (hm_sz_t t = 0; t < n_thread; t++) {
+    assert(hm_agg_map(agg, t)->sz == 0);
+  }
+  hm_close(map);
+  hm_agg_close(agg);
+}
+
+void test_hm_agg(void) {
+  check_hm_agg(0);
+  check_hm_agg(256);
+}
+
+// Every length up to a couple of rounds of rapidhash's long-key loop, under a few seeds.
+void test_hm_hash_rapidhash_n(void) {
+  hm_sz_t n = 256;
+  uint8_t buf[n];
+  void const* ks[n];
+  hm_sz_t k_szs[n];
+  hm_hash_t hs[n];
+  void* r = rand_open();
+  rand_read(r, buf, n);
+  rand_close(r);
+  for (hm_sz_t i = 0; i < n; i++) {
+    ks[i] = buf + i % 7;
+    k_szs[i] = i % (n - 6);
+  }
+  hm_hash_t seeds[] = {0, 1, 0xbdd89aa982704029ull, (hm_hash_t)-1};
+  for (int s = 0; s < 4; s++) {
+    hm_hash_rapidhash_n(ks, k_szs, n, seeds[s], hs);
+    for (hm_sz_t i = 0; i < n; i++) { assert(hs[i] == hm_hash_rapidhash(ks[i], k_szs[i], seeds[s])); }
+  }
+}
+
+void test_hm_get_n(void) {
+  hm_sz_t n = 1000;
+  hm_t* map = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  uint64_t keys[n];
+  void* ks[n];
+  hm_sz_t k_szs[n];
+  hm_item_t out[n];
+  for (hm_sz_t i = 0; i < n; i++) {
+    keys[i] = i * 2;
+    ks[i] = &keys[i];
+    k_szs[i] = sizeof(uint64_t);
+    if (i % 3 != 0) {
+      hm_put(map, &keys[i], sizeof(uint64_t), &i, sizeof(i));
+    }
+  }
+  hm_get_n(map, ks, k_szs, n, out);
+  for (hm_sz_t i = 0; i < n; i++) {
+    hm_item_t itm = hm_get(map, &keys[i], sizeof(uint64_t));
+    assert(out[i].k == itm.k);
+    assert((out[i].k == NULL) == (i % 3 == 0));
+  }
+  hm_close(map);
+}
+
+// Writes n records of i -> "v<i>", and loads them back in each mode.
+void test_hm_load(void) {
+  hm_sz_t n = HM_INITIAL_CAP * 8;
+  char const* bin_path = "test-salmagundi.bin";
+  char const* tsv_path = "test-salmagundi.tsv";
+  FILE* bin = fopen(bin_path, "wb");
+  FILE* tsv = fopen(tsv_path, "w");
+  assert(bin != NULL && tsv != NULL);
+  for (hm_sz_t i = 0; i < n; i++) {
+    char k[16];
+    char v[16];
+    uint32_t k_sz = snprintf(k, sizeof(k), "%u", i);
+    uint32_t v_sz = snprintf(v, sizeof(v), "v%u", i);
+    uint8_t k_sz_le[4] = {k_sz, k_sz >> 8, k_sz >> 16, k_sz >> 24};
+    uint8_t v_sz_le[4] = {v_sz, v_sz >> 8, v_sz >> 16, v_sz >> 24};
+    fwrite(k_sz_le, 1, 4, bin);
+    fwrite(k, 1, k_sz, bin);
+    fwrite(v_sz_le, 1, 4, bin);
+    fwrite(v, 1, v_sz, bin);
+    fprintf(tsv, "%s\t%s\n", k, v);
+  }
+  fclose(bin);
+  fclose(tsv);
+  for (int i = 0; i < 8; i++) {
+    int8_t borrow = i & 1;
+    hm_sz_t n_thread = i & 2 ? 4 : 1;
+    char const* path = i & 4 ? tsv_path : bin_path;
+    hm_t* map = hm_load(path, i & 4 ? HM_LOAD_TSV : HM_LOAD_BIN, hm_hash_rapidhash, hm_cmp_str, borrow, n_thread);
+    assert(map != NULL);
+    assert(map->sz == n);
+    assert((map->borrow != NULL) == borrow);
+    for (hm_sz_t j = 0; j < n; j += 7) {
+      char k[16];
+      char v[16];
+      hm_sz_t k_sz = snprintf(k, sizeof(k), "%u", j);
+      hm_sz_t v_sz = snprintf(v, sizeof(v), "v%u", j);
+      hm_item_t itm = hm_get(map, k, k_sz);
+      assert(itm.k != NULL);
+      assert(itm.v_sz == v_sz && memcmp(itm.v, v, v_sz) == 0);
+    }
+    // Borrowed items can still be overwritten and deleted.
+    char* k = "1";
+    hm_put(map, k, 1, "w", 1);
+    assert(memcmp(hm_get(map, k, 1).v, "w", 1) == 0);
+    hm_del(map, k, 1);
+    assert(hm_get(map, k, 1).k == NULL);
+    hm_close(map);
+  }
+  assert(hm_load("/nonexistent", HM_LOAD_BIN, hm_hash_rapidhash, hm_cmp_str, 0, 1) == NULL);
+  // Empty values on the last record, which ends the file.
+  bin = fopen(bin_path, "wb");
+  fwrite("\1\0\0\0a\1\0\0\0b\1\0\0\0k\0\0\0\0", 1, 19, bin);
+  fclose(bin);
+  char const* tsvs[] = {"a\tb\nk\t", "a\tb\nk"};
+  for (int i = 0; i < 6; i++) {
+    int8_t borrow = i & 1;
+    if (i >= 2) {
+      tsv = fopen(tsv_path, "w");
+      fputs(tsvs[(i - 2) / 2], tsv);
+      fclose(tsv);
+    }
+    hm_t* map = hm_load(i < 2 ? bin_path : tsv_path, i < 2 ? HM_LOAD_BIN : HM_LOAD_TSV, hm_hash_rapidhash, hm_cmp_str,
+                        borrow, 1);
+    assert(map != NULL && map->sz == 2);
+    assert(hm_get(map, "k", 1).k != NULL && hm_get(map, "k", 1).v_sz == 0);
+    assert(hm_del(map, "k", 1) == 1);
+    hm_close(map);
+  }
+  remove(bin_path);
+  remove(tsv_path);
+}
+
+void test_hm_intern(void) {
+  hm_intern_t* pool = hm_intern_open();
+  hm_sz_t n = HM_INITIAL_CAP * 4;
+  hm_sz_t handles[n];
+  for (hm_sz_t i = 0; i < n; i++) {
+    char k[32];
+    hm_sz_t k_sz = snprintf(k, sizeof(k), "https://tenant-%u.example", i % (n / 2));
+    handles[i] = hm_intern(pool, k, k_sz);
+    assert(handles[i] != (hm_sz_t)-1);
+    assert(hm_intern_find(pool, k, k_sz) == handles[i]);
+  }
+  assert(pool->set->sz == n / 2);
+  // Only the filled part of the arena was made writable.
+  assert(pool->arena_sz <= pool->arena_cap && pool->arena_cap < pool->set->borrow_sz);
+  // Handles outlive the lookup table growing under them.
+  for (hm_sz_t i = 0; i < n; i++) {
+    char k[32];
+    hm_sz_t k_sz = snprintf(k, sizeof(k), "https://tenant-%u.example", i % (n / 2));
+    assert(handles[i] == handles[i % (n / 2)]);
+    hm_sz_t stored_sz;
+    void const* stored = hm_intern_bytes(pool, handles[i], &stored_sz);
+    assert(stored_sz == k_sz && memcmp(stored, k, k_sz) == 0);
+  }
+  assert(hm_intern_find(pool, "absent", 6) == (hm_sz_t)-1);
+  // Maps keyed by handle.
+  hm_t* map = hm_open(hm_hash_u32, hm_cmp_u32);
+  for (hm_sz_t i = 0; i < n; i++) {
+    hm_put(map, &handles[i], sizeof(hm_sz_t), &i, sizeof(i));
+  }
+  assert(map->sz == n / 2);
+  assert(*(hm_sz_t*)hm_get(map, &handles[0], sizeof(hm_sz_t)).v == n / 2);
+  hm_close(map);
+  hm_intern_close(pool);
+}
+
+// Checks keys [0, n) against what was in the map when the snapshot was taken: i -> i.
+void* snap_reader_run(void* arg) {
+  hm_snap_t* snap = arg;
+  for (uint64_t i = 0; i < hm_snap_sz(snap); i++) {
+    hm_item_t itm = hm_snap_get(snap, &i, sizeof(i));
+    assert(itm.k != NULL && *(uint64_t*)itm.v == i);
+  }
+  return NULL;
+}
+
+// Walks a snapshot slot by slot, as an export would, checking it against the same i -> i.
+void* snap_walker_run(void* arg) {
+  hm_snap_t* snap = arg;
+  hm_sz_t n = 0;
+  for (hm_sz_t idx = 0; idx < hm_snap_cap(snap); idx++) {
+    hm_item_t itm = hm_snap_item(snap, idx);
+    if (itm.k != NULL) {
+      assert(*(uint64_t*)itm.k == *(uint64_t*)itm.v);
+      n++;
+    }
+  }
+  assert(n == hm_snap_sz(snap));
+  assert(hm_snap_item(snap, hm_snap_cap(snap)).k == NULL);
+  return NULL;
+}
+
+void test_hm_snapshot(void) {
+  uint64_t n = HM_INITIAL_CAP / 2;
+  hm_t* map = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  for (uint64_t i = 0; i < n; i++) {
+    hm_put(map, &i, sizeof(i), &i, sizeof(i));
+  }
+  hm_snap_t* snap = hm_snapshot(map);
+  assert(snap != NULL && hm_snap_sz(snap) == n);
+  pthread_t reader;
+  pthread_t walker;
+  pthread_create(&reader, NULL, snap_reader_run, snap);
+  pthread_create(&walker, NULL, snap_walker_run, snap);
+  // Overwrite, delete and insert enough to grow while the reader runs.
+  for (uint64_t i = 0; i < n * 4; i++) {
+    uint64_t v = i + 1;
+    if (i < n && i % 3 == 0) {
+      hm_del(map, &i, sizeof(i));
+    } else {
+      hm_put(map, &i, sizeof(i), &v, sizeof(v));
+    }
+  }
+  pthread_join(reader, NULL);
+  pthread_join(walker, NULL);
+  assert(map->n_grow > 0);
+  hm_snap_t* later = hm_snapshot(map);
+  snap_reader_run(snap);
+  for (uint64_t i = 0; i < n * 4; i++) {
+    hm_item_t itm = hm_get(map, &i, sizeof(i));
+    assert((itm.k == NULL) == (i < n && i % 3 == 0));
+    assert(itm.k == NULL || *(uint64_t*)itm.v == i + 1);
+    hm_item_t seen = hm_snap_get(later, &i, sizeof(i));
+    assert(seen.k == itm.k && seen.v == itm.v);
+  }
+  uint64_t absent = n * 4;
+  assert(hm_snap_get(snap, &absent, sizeof(absent)).k == NULL);
+  hm_snap_close(snap);
+  // The map keeps writing around the snapshot left open; Closing the map closes it.
+  for (uint64_t i = 0; i < n; i++) {
+    hm_del(map, &i, sizeof(i));
+  }
+  assert(hm_snap_get(later, &(uint64_t){1}, sizeof(uint64_t)).k != NULL);
+  hm_close(map);
+}
+
+void test_hm_tier(void) {
+  uint64_t n = HM_INITIAL_CAP * 8;
+  size_t budget = n / 8 * (sizeof(hm_item_t) + 8 + 64);
+  // The segment's path must be free; What is there already is left alone.
+  FILE* f = fopen("test-salmagundi.seg", "w");
+  fputs("keep", f);
+  fclose(f);
+  assert(hm_tier_open("test-salmagundi.seg", budget, hm_hash_rapidhash, hm_cmp_str) == NULL);
+  f = fopen("test-salmagundi.seg", "r");
+  char kept[8] = {0};
+  assert(fread(kept, 1, sizeof(kept), f) == 4 && memcmp(kept, "keep", 4) == 0);
+  fclose(f);
+  remove("test-salmagundi.seg");
+  hm_tier_t* tier = hm_tier_open("test-salmagundi.seg", budget, hm_hash_rapidhash, hm_cmp_str);
+  assert(tier != NULL);
+  uint64_t v[8] = {0};
+  for (uint64_t i = 0; i < n; i++) {
+    v[0] = i;
+    assert(hm_tier_put(tier, &i, sizeof(i), v, sizeof(v)) == 0);
+    assert(tier->hot_bytes <= budget);
+  }
+  assert(tier->hot->sz + tier->index_sz == n);
+  assert(tier->n_spill > 0 && tier->index_sz > 0);
+  // Every pass promotes what the one before spilled, until the dead records get compacted away.
+  for (int pass = 0; pass < 4; pass++) {
+    for (uint64_t i = 0; i < n; i++) {
+      int8_t status;
+      hm_item_t itm = hm_tier_get(tier, &i, sizeof(i), &status);
+      assert(status == 1);
+      assert(itm.k != NULL && itm.v_sz == sizeof(v) && *(uint64_t*)itm.v == i);
+    }
+    assert(tier->hot_bytes <= budget);
+  }
+  assert(tier->n_promote > 0 && tier->n_compact > 0);
+  assert(tier->hot->sz + tier->index_sz == n);
+  // Overwrite and delete keys wherever they are.
+  for (uint64_t i = 0; i < n; i += 2) {
+    v[0] = i + 1;
+    if (i % 4 == 0) {
+      assert(hm_tier_del(tier, &i, sizeof(i)) == 1);
+    } else {
+      assert(hm_tier_put(tier, &i, sizeof(i), v, sizeof(v)) == 0);
+    }
+  }
+  assert(tier->hot->sz + tier->index_sz == n - n / 4);
+  for (uint64_t i = 0; i < n; i++) {
+    int8_t status;
+    hm_item_t itm = hm_tier_get(tier, &i, sizeof(i), &status);
+    assert(status == (i % 4 != 0));
+    assert((itm.k == NULL) == (i % 4 == 0));
+    assert(itm.k == NULL || *(uint64_t*)itm.v == (i % 2 ? i : i + 1));
+  }
+  assert(hm_tier_del(tier, &n, sizeof(n)) == 0);
+  // A spilled entry which cannot be read back is an error, not a miss.
+  int fd = tier->fd;
+  tier->fd = -1;
+  uint64_t cold = 1;
+  while (hm_get(tier->hot, &cold, sizeof(cold)).k != NULL || cold % 4 == 0) {
+    cold++;
+  }
+  int8_t status;
+  assert(hm_tier_get(tier, &cold, sizeof(cold), &status).k == NULL && status == -1);
+  tier->fd = fd;
+  assert(hm_tier_get(tier, &cold, sizeof(cold), &status).k != NULL && status == 1);
+  hm_tier_close(tier);
+}
+
+// Overlapping snapshots, each closed once the one after it is open, as periodic exports do.
+void test_hm_snapshot_overlapping(void) {
+  uint64_t n = HM_INITIAL_CAP / 2;
+  hm_t* map = hm_open(hm_hash_rapidhash, hm_cmp_str);
+  uint64_t v[4] = {0};
+  for (uint64_t i = 0; i < n; i++) {
+    hm_put(map, &i, sizeof(i), v, sizeof(v));
+  }
+  hm_snap_t* prev = NULL;
+  hm_snap_t* snap = hm_snapshot(map);
+  for (uint64_t round = 1; round <= 50; round++) {
+    v[0] = round;
+    for (uint64_t i = 0; i < n; i++) {
+      hm_put(map, &i, sizeof(i), v, sizeof(v));
+    }
+    // Overwriting what no snapshot has seen yet happens in place.
+    uint64_t k = 0;
+    hm_put(map, &k, sizeof(k), v, sizeof(v));
+    if (prev != NULL) {
+      hm_snap_close(prev);
+    }
+    prev = snap;
+    snap = hm_snapshot(map);
+    // Only the values replaced while the older open snapshot was the newest are held.
+    assert(map->n_dead == n);
+    k = 1;
+    assert(*(uint64_t*)hm_snap_get(prev, &k, sizeof(k)).v == round - 1);
+    assert(*(uint64_t*)hm_snap_get(snap, &k, sizeof(k)).v == round);
+  }
+  hm_snap_close(prev);
+  hm_snap_close(snap);
+  assert(map->n_dead == 0);
+  hm_close(map);
+}
+
 int main(int argc, char** argv) {
   if (argc != 1) {
     printf("%s takes no arguments.\n", argv[0]);
     return 1;
   }
   test_hm_deleted_colliding_keys();
+  test_hm_deleted_colliding_head();
+  test_hm_deleted_interleaved_keys();
+  test_hm_seeds_differ();
+  test_hm_reseed_on_long_probe();
   test_hm_lifetime();
   test_hm_of_int_int();
   test_hm_of_str_str();
   test_hm_torture_low_collision_rate();
   test_hm_torture_medium_collision_rate();
   test_hm_torture_high_collision_rate();
+  test_hm_set();
+  test_hm_set_algebra();
+  test_hm_merge();
+  test_hm_agg();
+  test_hm_hash_rapidhash_n();
+  test_hm_get_n();
+  test_hm_load();
+  test_hm_intern();
+  test_hm_snapshot();
+  test_hm_snapshot_overlapping();
+  test_hm_tier();
   return 0;
 }